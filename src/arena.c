@@ -0,0 +1,99 @@
+
+/*
+Copyright (c) 2005, IBM Corporation All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met: Redistributions of source code must retain the above
+copyright notice, this list of conditions and the following disclaimer.
+Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation
+and/or other materials provided with the distribution.  Neither the name
+of the IBM Corporation nor the names of its contributors may be used to
+endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE
+*/
+#include "arena.h"
+
+#include <malloc.h>
+#include <string.h>
+#include <stdint.h>
+
+#define ARENA_FIRST_CHUNK 1024
+#define ARENA_MAX_CHUNK (64 * 1024)
+#define ARENA_ALIGN sizeof(void*)
+
+arena_t* arena_new() {
+   arena_t* self = malloc(sizeof(arena_t));
+   self->chunks = NULL;
+   self->next_size = ARENA_FIRST_CHUNK;
+   return self;
+}
+
+void arena_delete(arena_t* self) {
+   arenachunk_t* chunk = self->chunks;
+   while (chunk) {
+      arenachunk_t* next = chunk->next;
+      free(chunk);
+      chunk = next;
+   }
+   free(self);
+}
+
+void* arena_alloc(arena_t* self, size_t size) {
+   size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+   arenachunk_t* chunk = self->chunks;
+   if (!chunk || chunk->size - chunk->used < size) {
+      size_t chunk_size = self->next_size;
+      if (chunk_size < size)
+         chunk_size = size;
+      chunk = malloc(sizeof(arenachunk_t) + chunk_size);
+      chunk->size = chunk_size;
+      chunk->used = 0;
+      chunk->next = self->chunks;
+      self->chunks = chunk;
+      if (self->next_size < ARENA_MAX_CHUNK)
+         self->next_size *= 2;
+   }
+   void* result = chunk->data + chunk->used;
+   chunk->used += size;
+   return result;
+}
+
+char* arena_strdup(arena_t* self, const char* str) {
+   size_t len = strlen(str) + 1;
+   char* copy = arena_alloc(self, len);
+   memcpy(copy, str, len);
+   return copy;
+}
+
+char* arena_strndup(arena_t* self, const char* str, size_t len) {
+   char* copy = arena_alloc(self, len + 1);
+   memcpy(copy, str, len);
+   copy[len] = '\0';
+   return copy;
+}
+
+/*
+Whether ptr points into memory allocated from the arena.
+*/
+bool arena_contains(arena_t* self, const void* ptr) {
+   uintptr_t at = (uintptr_t) ptr;
+   for (arenachunk_t* chunk = self->chunks; chunk; chunk = chunk->next) {
+      if (at >= (uintptr_t) chunk->data && at < (uintptr_t) chunk->data + chunk->used)
+         return true;
+   }
+   return false;
+}
@@ -0,0 +1,62 @@
+
+/*
+Copyright (c) 2005, IBM Corporation All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met: Redistributions of source code must retain the above
+copyright notice, this list of conditions and the following disclaimer.
+Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation
+and/or other materials provided with the distribution.  Neither the name
+of the IBM Corporation nor the names of its contributors may be used to
+endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE
+*/
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+typedef struct arenachunk arenachunk_t;
+
+struct arenachunk {
+   arenachunk_t* next;
+   size_t size;
+   size_t used;
+   char data[];
+};
+
+typedef struct arena arena_t;
+
+/*
+A bump allocator. Memory is taken from a list of chunks, which grow
+in size up to a limit, and is only released all at once by
+arena_delete().
+*/
+struct arena {
+   arenachunk_t* chunks;
+   size_t next_size;
+};
+
+arena_t* arena_new();
+void arena_delete(arena_t* self);
+void* arena_alloc(arena_t* self, size_t size);
+char* arena_strdup(arena_t* self, const char* str);
+char* arena_strndup(arena_t* self, const char* str, size_t len);
+bool arena_contains(arena_t* self, const void* ptr);
+
+#endif
@@ -33,6 +33,8 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE
 
 static char* default_watch_dir = "/Packages";
 
+#define DEFAULT_DELAY 500
+
 static char* default_argv[] = {"viewfs", "--help"};
 
 static bool try_param(int argc, char** argv, int* i, char* flag, char* error_message, char** data) {
@@ -53,10 +55,14 @@ static bool try_param(int argc, char** argv, int* i, char* flag, char* error_mes
    return false;
 }
 
-void parse_cmdline(int argc, char** argv, char** out_watch_dir, char** out_mountpoint, int* out_foreground) {
+void parse_cmdline(int argc, char** argv, char** out_watch_dir, char** out_mountpoint, int* out_foreground, bool* out_lazy, char** out_snapshot, int* out_jobs, int* out_delay) {
    char* watch_dir = default_watch_dir;
    char* mountpoint = NULL;
    int foreground = 0;
+   bool lazy = false;
+   char* snapshot = NULL;
+   char* jobs = NULL;
+   char* delay = NULL;
    if (argc == 1) {
       argc = 2;
       argv = default_argv;
@@ -66,17 +72,31 @@ void parse_cmdline(int argc, char** argv, char** out_watch_dir, char** out_mount
       if (strcmp(argv[i], "--help") == 0) {
          fprintf(stderr, "Run the viewfs daemon.\n\n");
          fprintf(stderr, "Usage:\n");
-         fprintf(stderr, "   viewfs [-w <watchdir>] <mountpoint> [-f]\n\n");
+         fprintf(stderr, "   viewfs [-w <watchdir>] <mountpoint> [-f] [-l] [-s <snapshot>] [-j <jobs>] [-d <ms>]\n\n");
          fprintf(stderr, "\t-w\tSpecify a directory to watch for entries. Default is %s\n", default_watch_dir);
-         fprintf(stderr, "\t-f\tRun in foreground, do not daemonize.\n\n");
+         fprintf(stderr, "\t-f\tRun in foreground, do not daemonize.\n");
+         fprintf(stderr, "\t-l\tLoad Manifests on first access instead of at mount time.\n");
+         fprintf(stderr, "\t-s\tStart from a snapshot file of the views if it is up to date,\n\t\tand rewrite it after a full scan otherwise.\n");
+         fprintf(stderr, "\t-j\tNumber of threads loading Manifests in the initial scan. Default is 1.\n");
+         fprintf(stderr, "\t-d\tMilliseconds without changes to wait before loading new packages.\n\t\tDefault is %d; 0 loads them as soon as they appear.\n\n", DEFAULT_DELAY);
          exit(0);
       }
       if (try_param(argc, argv, &i, "-w", "absolute path of entries dir", &watch_dir))
          continue;
+      if (try_param(argc, argv, &i, "-s", "path of snapshot file", &snapshot))
+         continue;
+      if (try_param(argc, argv, &i, "-j", "number of threads", &jobs))
+         continue;
+      if (try_param(argc, argv, &i, "-d", "delay in milliseconds", &delay))
+         continue;
       if (strcmp(argv[i], "-f") == 0) {
          foreground = 1;
          continue;
       }
+      if (strcmp(argv[i], "-l") == 0) {
+         lazy = true;
+         continue;
+      }
       if (!mountpoint) {
          mountpoint = strdup(argv[i]);
       }
@@ -87,5 +107,13 @@ void parse_cmdline(int argc, char** argv, char** out_watch_dir, char** out_mount
    }
    *out_mountpoint = mountpoint;
    *out_foreground = foreground;
+   *out_lazy = lazy;
+   *out_snapshot = snapshot;
+   *out_jobs = jobs ? atoi(jobs) : 1;
+   if (*out_jobs < 1)
+      *out_jobs = 1;
+   *out_delay = delay ? atoi(delay) : DEFAULT_DELAY;
+   if (*out_delay < 0)
+      *out_delay = 0;
    *out_watch_dir = watch_dir;
 }
@@ -4,6 +4,6 @@
 
 #include <stdbool.h>
 
-void parse_cmdline(int argc, char** argv, char** out_watch_dir, char** out_mountpoint, int* out_foreground);
+void parse_cmdline(int argc, char** argv, char** out_watch_dir, char** out_mountpoint, int* out_foreground, bool* out_lazy, char** out_snapshot, int* out_jobs, int* out_delay);
 
 #endif
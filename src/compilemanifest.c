@@ -0,0 +1,60 @@
+
+/*
+Copyright (c) 2005, IBM Corporation All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met: Redistributions of source code must retain the above
+copyright notice, this list of conditions and the following disclaimer.
+Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation
+and/or other materials provided with the distribution.  Neither the name
+of the IBM Corporation nor the names of its contributors may be used to
+endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "manifest.h"
+
+/*
+Compiles the Manifest of each package version directory given
+on the command line into its COMPILED_MANIFEST_FILE.
+*/
+int main(int argc, char** argv) {
+   if (argc == 1 || strcmp(argv[1], "--help") == 0) {
+      fprintf(stderr, "Compile Manifests for faster loading by viewfs.\n\n");
+      fprintf(stderr, "Usage:\n");
+      fprintf(stderr, "   viewfs-compile-manifest <package>/<version>...\n\n");
+      return argc == 1;
+   }
+   int result = 0;
+   for (int i = 1; i < argc; i++) {
+      char* manifest;
+      char* output;
+      asprintf(&manifest, "%s/%s", argv[i], MANIFEST_FILE);
+      asprintf(&output, "%s/%s", argv[i], COMPILED_MANIFEST_FILE);
+      if (!manifest_compile(manifest, output)) {
+         fprintf(stderr, "viewfs-compile-manifest: could not compile %s\n", manifest);
+         result = 1;
+      }
+      free(manifest);
+      free(output);
+   }
+   return result;
+}
@@ -25,6 +25,7 @@ LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
 NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
 SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE
 */
+#define _GNU_SOURCE
 #include <string.h>
 #include <stdio.h>
 #include <stdbool.h>
@@ -34,6 +35,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE
 #include <ctype.h>
 
 #include "depfile.h"
+#include "version.h"
 
 #define LINE_WIDTH (PATH_MAX + 3)
 
@@ -63,16 +65,87 @@ depwait_t* depwait_new(dep_t* dep, entrydata_t* view) {
    return self;
 }
 
-bool depwait_find(void* item_cast, void* sample_cast) {
-   depwait_t* item = (depwait_t*) item_cast;
-   char* sample = (char*) sample_cast;
-   return (strcasecmp(sample, item->dep->name) == 0);
-}
-
 void depwait_delete(void* self) {
    free(self);
 }
 
+typedef struct depwaitbucket {
+   list_t* waits;
+   int count;
+} depwaitbucket_t;
+
+depwaits_t* depwaits_new() {
+   depwaits_t* self = malloc(sizeof(depwaits_t));
+   self->packages = stringset_new(NULL);
+   self->count = 0;
+   return self;
+}
+
+static depwaitbucket_t* depwaits_bucket(depwaits_t* self, const char* package, bool create) {
+   char key[PATH_MAX];
+   int i;
+   for (i = 0; package[i] && i < PATH_MAX - 1; i++)
+      key[i] = tolower((unsigned char) package[i]);
+   key[i] = '\0';
+   depwaitbucket_t* bucket = stringset_get(self->packages, key);
+   if (!bucket && create) {
+      bucket = malloc(sizeof(depwaitbucket_t));
+      bucket->waits = NULL;
+      bucket->count = 0;
+      stringset_put(self->packages, key, bucket);
+   }
+   return bucket;
+}
+
+void depwaits_add(depwaits_t* self, depwait_t* depwait) {
+   depwaitbucket_t* bucket = depwaits_bucket(self, depwait->dep->name, true);
+   if (!bucket->waits)
+      bucket->waits = list_new();
+   list_put(bucket->waits, 0, depwait);
+   bucket->count++;
+   self->count++;
+}
+
+/*
+Removes and returns the depwaits for a package, or NULL if there
+are none. The caller owns the returned list.
+*/
+list_t* depwaits_take(depwaits_t* self, const char* package) {
+   depwaitbucket_t* bucket = depwaits_bucket(self, package, false);
+   if (!bucket || !bucket->waits)
+      return NULL;
+   list_t* waits = bucket->waits;
+   self->count -= bucket->count;
+   bucket->waits = NULL;
+   bucket->count = 0;
+   return waits;
+}
+
+/*
+Returns the number of depwaits pending on a package.
+*/
+int depwaits_pending(depwaits_t* self, const char* package) {
+   depwaitbucket_t* bucket = depwaits_bucket(self, package, false);
+   return bucket ? bucket->count : 0;
+}
+
+/*
+Deletes the depwaits of all packages that match a sample.
+*/
+void depwaits_remove(depwaits_t* self, list_find_fn match, void* sample) {
+   stringset_begin_iterate(depwaitbucket_t, bucket, self->packages);
+      if (!bucket->waits)
+         continue;
+      list_iter_t iter = { bucket->waits, bucket->waits->hd };
+      depwait_t* depwait;
+      while ( (depwait = list_iterate_take(&iter, sample, match)) ) {
+         depwait_delete(depwait);
+         bucket->count--;
+         self->count--;
+      }
+   stringset_end_iterate(bucket);
+}
+
 // ---------------------------------------------------------------------------
 
 static inline int depfile_get_token(char* token, char* line, int* x) {
@@ -168,14 +241,15 @@ void dep_set_chosen(dep_t* self, entrydata_t* chosen) {
    self->chosen = chosen;
 }
 
-static void dep_add_constraint(dep_t* self, relation_t kind, char* version) {
+void dep_add_constraint(dep_t* self, relation_t kind, char* version) {
    constraint_t* c = malloc(sizeof(constraint_t));
    c->kind = kind;
    c->version = strdup(version);
+   str_to_version_key(c->version, &c->version_key);
    list_put(self->constraints, 0, c);
 }
 
-static void dep_delete(void* self_cast) {
+void dep_delete(void* self_cast) {
    dep_t* self = (dep_t*) self_cast;
    free(self->name);
    list_delete(self->constraints, constraint_delete);
@@ -58,6 +58,8 @@ typedef struct constraint {
    // A version "number", as a string.
    // Example: "1.10k"
    char* version;
+   // The version parsed with str_to_version_key.
+   versionkey_t version_key;
 } constraint_t;
 
 // Data about a specific program in a dependencies file.
@@ -85,18 +87,38 @@ typedef struct depwait {
    entrydata_t* view;
 } depwait_t;
 
+// Depwaits grouped by the case-folded name of the package
+// they are waiting for.
+typedef struct depwaits {
+   stringset_t* packages;
+   // Number of depwaits in all packages.
+   int count;
+} depwaits_t;
+
 typedef void (*depfile_parse_app_fn)(void*, char*, relation_t, char*);
 
 depwait_t* depwait_new(dep_t* dep, entrydata_t* view);
 
-bool depwait_find(void* item_cast, void* sample_cast);
-
 void depwait_delete(void* self_cast);
 
+depwaits_t* depwaits_new();
+
+void depwaits_add(depwaits_t* self, depwait_t* depwait);
+
+list_t* depwaits_take(depwaits_t* self, const char* package);
+
+int depwaits_pending(depwaits_t* self, const char* package);
+
+void depwaits_remove(depwaits_t* self, list_find_fn match, void* sample);
+
 dep_t* dep_new(char* name);
 
 void dep_set_chosen(dep_t* self, entrydata_t* chosen);
 
+void dep_add_constraint(dep_t* self, relation_t kind, char* version);
+
+void dep_delete(void* self_cast);
+
 bool dep_find(void* item_cast, void* sample_cast);
 
 list_t* depfile_parse(char* filename);
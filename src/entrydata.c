@@ -25,93 +25,295 @@ LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
 NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
 SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE
 */
+#define _GNU_SOURCE
 #include <stdarg.h>
 #include <malloc.h>
 #include <string.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <assert.h>
 
 #include "entrydata.h"
+#include "version.h"
 #include "vect.h"
 
-entrydata_t* entrydata_new(entrytype_t type, ...) {
-   va_list ap;
+static int view_count = 0;
+
+static entrydata_t* entrydata_vnew(arena_t* arena, entrytype_t type, va_list ap) {
    entrydata_t* self;
-   va_start(ap, type);
+   if (arena && type != ET_VIEW) {
+      self = arena_alloc(arena, sizeof(entrydata_t));
+      self->flags = EF_ARENA;
+   } else {
+      self = malloc(sizeof(entrydata_t));
+      self->flags = 0;
+   }
+   self->parent = NULL;
+   self->name = NULL;
+   self->subdirs = 0;
    switch (type) {
       case ET_LINK:
          {
             entrydata_t* view = va_arg(ap, entrydata_t*);
-            char* realpath = va_arg(ap, char*);
-            self = malloc(sizeof(entrydata_t));
-            self->u.link.view = calloc(2, sizeof(entrydata_t*));
-            self->u.link.path = strdup(realpath);
+            self->parent = va_arg(ap, entrydata_t*);
+            char* name = va_arg(ap, char*);
+            if (arena) {
+               self->u.link.view = arena_alloc(arena, 2 * sizeof(entrydata_t*));
+               self->flags |= EF_ARENA_VIEWS;
+            } else {
+               self->u.link.view = calloc(2, sizeof(entrydata_t*));
+            }
+            if (name)
+               self->name = arena ? arena_strdup(arena, name) : strdup(name);
             self->u.link.view[0] = view;
             self->u.link.view[1] = NULL;
-            strcpy(self->u.link.path, realpath);
+            self->u.link.epoch = 0;
             break;
          }
       case ET_DIR:
          {
-            self = calloc(1, sizeof(entrydata_t));
             self->u.dir.entries = va_arg(ap, stringset_t*);
-            self->u.dir.global = NULL;
+            self->u.dir.pending = NULL;
+            self->u.dir.versions = NULL;
+            self->u.dir.refs = 0;
+            self->u.dir.last_view = -1;
+            self->parent = va_arg(ap, entrydata_t*);
+            char* name = va_arg(ap, char*);
+            if (name)
+               self->name = arena ? arena_strdup(arena, name) : strdup(name);
             break;
          }
       case ET_VIEW:
          {
             char* package = va_arg(ap, char*);
             char* version = va_arg(ap, char*);
-            self = malloc(sizeof(entrydata_t));
             self->u.view = calloc(1, sizeof(viewdata_t));
             self->u.view->package = strdup(package);
             self->u.view->version = strdup(version);
+            str_to_version_key(self->u.view->version, &self->u.view->version_key);
+            self->u.view->index = view_count++;
             break;
          }
    }
-   va_end(ap);
    self->type = type;
    return self;
 }
 
+entrydata_t* entrydata_new(entrytype_t type, ...) {
+   va_list ap;
+   va_start(ap, type);
+   entrydata_t* self = entrydata_vnew(NULL, type, ap);
+   va_end(ap);
+   return self;
+}
+
+/*
+Like entrydata_new, but links and directories are allocated from
+the given arena. ET_VIEW entries are always allocated with malloc.
+*/
+entrydata_t* entrydata_new_in(arena_t* arena, entrytype_t type, ...) {
+   va_list ap;
+   va_start(ap, type);
+   entrydata_t* self = entrydata_vnew(arena, type, ap);
+   va_end(ap);
+   return self;
+}
+
 void entrydata_add_subentry(entrydata_t* self, const char* name, entrydata_t* sub) {
    if (!self->u.dir.entries)
       self->u.dir.entries = stringset_new(NULL);
-   stringset_put(self->u.dir.entries, name, sub);
+   if (stringset_put(self->u.dir.entries, name, sub)) {
+      sub->parent = self;
+      entrydata_count_subdir(self, sub, 1);
+   }
+}
+
+/*
+Counts an entry added to (delta 1) or removed from (delta -1) a
+directory; only entries other than links are counted.
+*/
+void entrydata_count_subdir(entrydata_t* self, entrydata_t* sub, int delta) {
+   if (sub->type == ET_LINK)
+      return;
+   assert(delta > 0 || self->subdirs > 0);
+   self->subdirs += delta;
 }
 
+/*
+Views are kept in creation order, so that the resulting array
+does not depend on the order in which Manifests were loaded.
+*/
 void entrydata_add_view_to_link(entrydata_t* self, entrydata_t* view) {
    int count = 0;
    while (self->u.link.view[count] != NULL)
       count++;
-   self->u.link.view = realloc(self->u.link.view, sizeof(entrydata_t*) * (count+2));
-   self->u.link.view[count] = view;
+   if (self->flags & EF_ARENA_VIEWS) {
+      entrydata_t** views = malloc(sizeof(entrydata_t*) * (count+2));
+      memcpy(views, self->u.link.view, sizeof(entrydata_t*) * count);
+      self->u.link.view = views;
+      self->flags &= ~EF_ARENA_VIEWS;
+   } else {
+      self->u.link.view = realloc(self->u.link.view, sizeof(entrydata_t*) * (count+2));
+   }
+   int at = count;
+   while (at > 0 && self->u.link.view[at-1]->u.view->index > view->u.view->index) {
+      self->u.link.view[at] = self->u.link.view[at-1];
+      at--;
+   }
+   self->u.link.view[at] = view;
    self->u.link.view[count+1] = NULL;
 }
 
+void entrydata_add_pending_view(entrydata_t* self, entrydata_t* view) {
+   if (!self->u.dir.pending)
+      self->u.dir.pending = list_new();
+   list_put(self->u.dir.pending, 0, view);
+}
+
 /*
-void entrydata_remove_view_from_link(entrydata_t* self, const char* view_name) {
-   int i, j = 0;
+Adds a view to a package node, also inserting it in the version
+index. Views with equivalent versions keep their insertion order.
+*/
+void entrydata_add_version(entrydata_t* self, const char* name, entrydata_t* view) {
+   entrydata_add_subentry(self, name, view);
+   if (!self->u.dir.versions)
+      self->u.dir.versions = vect_new(8);
+   vect_t* versions = self->u.dir.versions;
+   int64_t at = vect_add(versions, view);
+   while (at > 0) {
+      entrydata_t* prev = versions->array[at-1];
+      if (compare_version_keys(&prev->u.view->version_key, &view->u.view->version_key) <= 0)
+         break;
+      versions->array[at] = prev;
+      at--;
+   }
+   versions->array[at] = view;
+}
+
+void entrydata_record(entrydata_t* view, entrydata_t* entry) {
+   if (!view->u.view->touched)
+      view->u.view->touched = vect_new(64);
+   vect_add(view->u.view->touched, entry);
+}
+
+/*
+Counts a view as a reference to a directory, once per view.
+A view's Manifest is loaded in one go, so it is enough to
+remember the last view that touched the directory.
+*/
+void entrydata_touch_dir(entrydata_t* self, entrydata_t* view) {
+   if (self->u.dir.last_view == view->u.view->index)
+      return;
+   self->u.dir.refs++;
+   self->u.dir.last_view = view->u.view->index;
+   entrydata_record(view, self);
+}
+
+/*
+Removes a view from the views of a link.
+Returns true if the link was left with no views.
+*/
+bool entrydata_remove_view_from_link(entrydata_t* self, entrydata_t* view) {
+   int i, j;
    for (i = 0, j = 0; self->u.link.view[i] != NULL; i++) {
-      if (j < i)
-         self->u.link.view[j] = self->u.link.view[i];
-      if (self->u.link.view[i] != view_name)
-         j++;
+      if (self->u.link.view[i] != view)
+         self->u.link.view[j++] = self->u.link.view[i];
    }
    self->u.link.view[j] = NULL;
-   self->u.link.view = realloc(self->u.link.view, sizeof(char*) * (j+1));
+   return j == 0;
+}
+
+/*
+Takes an entry out of its directory. The entry is not freed, since
+the kernel may still hold ids for it; it is only marked as dead.
+*/
+void entrydata_unlink(entrydata_t* self) {
+   if (self->parent && self->parent->u.dir.entries && self->name
+       && stringset_remove(self->parent->u.dir.entries, self->name, NULL))
+      entrydata_count_subdir(self->parent, self, -1);
+   self->flags |= EF_DEAD;
 }
+
+/*
+Makes a copy of a link allocated with malloc, for a link that has
+to outlive the arena it was allocated from.
 */
+entrydata_t* entrydata_copy_link(entrydata_t* self) {
+   int count = 0;
+   while (self->u.link.view[count] != NULL)
+      count++;
+   entrydata_t* copy = malloc(sizeof(entrydata_t));
+   *copy = *self;
+   copy->flags = 0;
+   copy->name = self->name ? strdup(self->name) : NULL;
+   copy->u.link.view = malloc(sizeof(entrydata_t*) * (count+1));
+   memcpy(copy->u.link.view, self->u.link.view, sizeof(entrydata_t*) * (count+1));
+   return copy;
+}
 
 void entrydata_delete(void* cast) {
    entrydata_t* self = (entrydata_t*) cast;
    switch (self->type) {
       case ET_LINK:
+         if (!(self->flags & EF_ARENA_VIEWS))
+            free(self->u.link.view);
          break;
       case ET_DIR:
-         stringset_delete(self->u.dir.entries, entrydata_delete);
+         if (self->u.dir.entries)
+            stringset_delete(self->u.dir.entries, entrydata_delete);
+         if (self->u.dir.versions)
+            vect_delete(self->u.dir.versions);
          break;
       case ET_VIEW:
-         break;
+         {
+            // The dependency rules are left to the caller.
+            viewdata_t* view = self->u.view;
+            free(view->package);
+            free(view->version);
+            if (view->resolved)
+               vect_delete(view->resolved);
+            if (view->dep_names)
+               stringset_delete(view->dep_names, NULL);
+            if (view->priority_views)
+               list_delete(view->priority_views, NULL);
+            free(view->ranks);
+            if (view->touched)
+               vect_delete(view->touched);
+            if (view->dependents)
+               list_delete(view->dependents, NULL);
+            if (view->arena)
+               arena_delete(view->arena);
+            free(view);
+            break;
+         }
+   }
+   if (!(self->flags & EF_ARENA)) {
+      free(self->name);
+      free(self);
+   }
+}
+
+/*
+Writes the path of the entry relative to the root of its tree,
+following the parent pointers. Returns the length of the path,
+or -1 if it does not fit in size bytes.
+*/
+int entrydata_path(entrydata_t* self, char* buf, int size) {
+   entrydata_t* chain[PATH_MAX / 2];
+   int depth = 0;
+   for (entrydata_t* at = self; at && at->name && depth < PATH_MAX / 2; at = at->parent)
+      chain[depth++] = at;
+   int len = 0;
+   for (int i = depth - 1; i >= 0; i--) {
+      int namelen = strlen(chain[i]->name);
+      if (len + namelen + 2 > size)
+         return -1;
+      memcpy(buf + len, chain[i]->name, namelen);
+      len += namelen;
+      if (i > 0)
+         buf[len++] = '/';
    }
-   free(self);
+   if (size > 0)
+      buf[len] = '\0';
+   return len;
 }
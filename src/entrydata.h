@@ -29,9 +29,17 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE
 #define ENTRYDATA_H
 
 #include <stdint.h>
+#include <stdbool.h>
 
 #include "stringset.h"
 #include "list.h"
+#include "arena.h"
+#include "vect.h"
+#include "version.h"
+
+#define MANIFEST_FILE "Manifest"
+#define DEPENDENCIES_FILE "Dependencies"
+#define COMPILED_MANIFEST_FILE "Manifest.bin"
 
 typedef enum entrytype entrytype_t;
 
@@ -44,33 +52,115 @@ enum entrytype {
    ET_VIEW
 };
 
+/* The node and its name were allocated from an arena */
+#define EF_ARENA 1
+/* The link's view array was allocated from an arena */
+#define EF_ARENA_VIEWS 2
+/* The entry was removed from the tree, along with its views */
+#define EF_DEAD 4
+/* The link was copied out of the arena of a removed view;
+   parent points to the copy */
+#define EF_MOVED 8
+/* The directory was created by defer_view, and its pending views
+   were not loaded yet */
+#define EF_HINT 16
+
 typedef struct entrydata entrydata_t;
 
+typedef struct viewrank {
+   int index;
+   int rank;
+} viewrank_t;
+
 typedef struct viewdata {
    char* package;
    char* version;
+   // The version parsed with str_to_version_key.
+   versionkey_t version_key;
    list_t* dep_rules;
+   // Set once the view was found to have no Dependencies file.
+   bool no_dependencies;
+   // View chosen for each of dep_rules, in the same order,
+   // or NULL for unmet rules. Valid while resolved_epoch
+   // matches the epoch of the version indexes.
+   vect_t* resolved;
+   uint64_t resolved_epoch;
+   // Names of the packages already visited when resolving
+   // the dependencies of this view as a root.
+   stringset_t* dep_names;
    list_t* priority_views;
+   // Creation order of the view; links keep their views sorted by it.
+   int index;
+   // Whether the Manifest has been merged into the tree.
+   bool loaded;
+   // Modification time of the Manifest when it was loaded,
+   // in nanoseconds; 0 if there was none.
+   int64_t mtime;
+   // Holds the links created when loading the Manifest.
+   arena_t* arena;
+   // Position in priority_views of each view in the list, starting
+   // at 1, sorted by view index.
+   viewrank_t* ranks;
+   int rank_count;
+   uint64_t rank_epoch;
+   // Value of the link epoch when priority_views last changed.
+   uint64_t priority_epoch;
+   // Links and directories of the tree that the Manifest added
+   // itself to, so that they can be found again on removal.
+   vect_t* touched;
+   // Root views that have this view in their priority lists.
+   list_t* dependents;
+   // Whether the view was removed from its package.
+   bool removed;
 } viewdata_t;
 
 struct entrydata {
-   entrytype_t type;
+   // An entrytype_t, kept in a byte so that subdirs fits beside it.
+   unsigned char type;
+   unsigned char flags;
+   // For directories, the number of entries that are not links.
+   unsigned int subdirs;
+   // Directory holding the entry in the view tree, and the
+   // entry's name in it. NULL for the root and outside the tree.
+   entrydata_t* parent;
+   char* name;
    union {
       struct {
-         char* path;
          entrydata_t** view;
+         // Value of the link epoch when view last changed.
+         uint64_t epoch;
       } link;
       struct {
          stringset_t* entries;
-         entrydata_t* global;
+         // Views whose Manifests must be loaded before
+         // entries is complete. NULL if materialized.
+         list_t* pending;
+         // For package nodes, the views in entries sorted
+         // newest first by version key. NULL elsewhere.
+         vect_t* versions;
+         // Number of views whose Manifests list the directory
+         // or something below it, and the last of them to be
+         // counted; directories left with none are pruned.
+         int refs;
+         int last_view;
       } dir;
       viewdata_t* view;
    } u;
 };
 
 entrydata_t* entrydata_new(entrytype_t type, ...);
+entrydata_t* entrydata_new_in(arena_t* arena, entrytype_t type, ...);
 void entrydata_delete(void* cast);
 void entrydata_add_subentry(entrydata_t* self, const char* name, entrydata_t* sub);
+void entrydata_count_subdir(entrydata_t* self, entrydata_t* sub, int delta);
 void entrydata_add_view_to_link(entrydata_t* self, entrydata_t* view);
+void entrydata_add_pending_view(entrydata_t* self, entrydata_t* view);
+void entrydata_add_version(entrydata_t* self, const char* name, entrydata_t* view);
+int entrydata_path(entrydata_t* self, char* buf, int size);
+void entrydata_record(entrydata_t* view, entrydata_t* entry);
+void entrydata_touch_dir(entrydata_t* self, entrydata_t* view);
+bool entrydata_remove_view_from_link(entrydata_t* self, entrydata_t* view);
+void entrydata_unlink(entrydata_t* self);
+entrydata_t* entrydata_copy_link(entrydata_t* self);
 
 #endif
@@ -0,0 +1,140 @@
+
+/*
+Copyright (c) 2005, IBM Corporation All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met: Redistributions of source code must retain the above
+copyright notice, this list of conditions and the following disclaimer.
+Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation
+and/or other materials provided with the distribution.  Neither the name
+of the IBM Corporation nor the names of its contributors may be used to
+endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE
+*/
+#include "idmap.h"
+
+#include <malloc.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+
+static inline uint64_t idmap_hash(entrydata_t* view, entrydata_t* node) {
+   uint64_t h = (uint64_t)(uintptr_t) view * 0x9e3779b97f4a7c15ULL;
+   h ^= (uint64_t)(uintptr_t) node + 0x7f4a7c159e3779b9ULL + (h << 6) + (h >> 2);
+   h ^= h >> 33;
+   h *= 0xff51afd7ed558ccdULL;
+   h ^= h >> 33;
+   return h;
+}
+
+idmap_t* idmap_new(int64_t size) {
+   idmap_t* self = malloc(sizeof(idmap_t));
+   int64_t real = 16;
+   while (real < size)
+      real *= 2;
+   self->slots = calloc(real, sizeof(idmapslot_t));
+   self->size = real;
+   self->used = 0;
+   return self;
+}
+
+void idmap_delete(idmap_t* self) {
+   free(self->slots);
+   free(self);
+}
+
+static inline int64_t idmap_find(idmap_t* self, entrydata_t* view, entrydata_t* node) {
+   int64_t mask = self->size - 1;
+   int64_t i = idmap_hash(view, node) & mask;
+   while (self->slots[i].id) {
+      if (self->slots[i].view == view && self->slots[i].node == node)
+         return i;
+      i = (i + 1) & mask;
+   }
+   return -1 - i;
+}
+
+static void idmap_grow(idmap_t* self) {
+   idmapslot_t* old = self->slots;
+   int64_t oldsize = self->size;
+   self->size *= 2;
+   self->slots = calloc(self->size, sizeof(idmapslot_t));
+   int64_t mask = self->size - 1;
+   for (int64_t j = 0; j < oldsize; j++) {
+      if (!old[j].id)
+         continue;
+      int64_t i = idmap_hash(old[j].view, old[j].node) & mask;
+      while (self->slots[i].id)
+         i = (i + 1) & mask;
+      self->slots[i] = old[j];
+   }
+   free(old);
+}
+
+uint64_t idmap_get(idmap_t* self, entrydata_t* view, entrydata_t* node) {
+   int64_t i = idmap_find(self, view, node);
+   return i < 0 ? 0 : self->slots[i].id;
+}
+
+void idmap_put(idmap_t* self, entrydata_t* view, entrydata_t* node, uint64_t id) {
+   if (id == 0)
+      return;
+   int64_t i = idmap_find(self, view, node);
+   if (i >= 0) {
+      self->slots[i].id = id;
+      return;
+   }
+   if ((self->used + 1) * 4 > self->size * 3) {
+      idmap_grow(self);
+      i = idmap_find(self, view, node);
+   }
+   i = -1 - i;
+   self->slots[i].view = view;
+   self->slots[i].node = node;
+   self->slots[i].id = id;
+   self->used++;
+}
+
+/*
+Removes the pair and returns its id, or 0 if it was not present.
+Uses backward-shift deletion, so no tombstones are left behind.
+*/
+uint64_t idmap_remove(idmap_t* self, entrydata_t* view, entrydata_t* node) {
+   int64_t i = idmap_find(self, view, node);
+   if (i < 0)
+      return 0;
+   uint64_t id = self->slots[i].id;
+   int64_t mask = self->size - 1;
+   int64_t j = i;
+   while (true) {
+      j = (j + 1) & mask;
+      if (!self->slots[j].id)
+         break;
+      int64_t k = idmap_hash(self->slots[j].view, self->slots[j].node) & mask;
+      // Move slot j into the hole at i unless its home k lies cyclically in (i, j].
+      if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j))
+         continue;
+      self->slots[i] = self->slots[j];
+      i = j;
+   }
+   self->slots[i].id = 0;
+   self->slots[i].view = NULL;
+   self->slots[i].node = NULL;
+   self->used--;
+   return id;
+}
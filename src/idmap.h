@@ -0,0 +1,61 @@
+
+/*
+Copyright (c) 2005, IBM Corporation All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met: Redistributions of source code must retain the above
+copyright notice, this list of conditions and the following disclaimer.
+Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation
+and/or other materials provided with the distribution.  Neither the name
+of the IBM Corporation nor the names of its contributors may be used to
+endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE
+*/
+#ifndef IDMAP_H
+#define IDMAP_H
+
+#include <stdint.h>
+
+#include "entrydata.h"
+
+typedef struct idmapslot idmapslot_t;
+
+struct idmapslot {
+   entrydata_t* view;
+   entrydata_t* node;
+   uint64_t id;
+};
+
+typedef struct idmap idmap_t;
+
+/*
+Open-addressing hash table mapping (view, node) pairs to ids.
+Slots with id 0 are empty; id 0 is reserved and never stored.
+*/
+struct idmap {
+   idmapslot_t* slots;
+   int64_t size;
+   int64_t used;
+};
+
+idmap_t* idmap_new(int64_t size);
+void idmap_delete(idmap_t* self);
+uint64_t idmap_get(idmap_t* self, entrydata_t* view, entrydata_t* node);
+void idmap_put(idmap_t* self, entrydata_t* view, entrydata_t* node, uint64_t id);
+uint64_t idmap_remove(idmap_t* self, entrydata_t* view, entrydata_t* node);
+
+#endif
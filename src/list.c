@@ -84,7 +84,8 @@ void list_delete(list_t* self, list_delete_fn fn) {
    while (item) {
       listitem_t* curr = item;
       item = item->next;
-      fn(curr->data);
+      if (fn)
+         fn(curr->data);
       free(curr);
    }
    free(self);
@@ -65,6 +65,7 @@ void list_put(list_t* self, int id, void* data);
 void list_prepend(list_t* self, int id, void* data);
 void* list_get(list_t* self, int id);
 void* list_find(list_t* self, void* sample, list_find_fn fn);
+void* list_find_take(list_t* self, void* sample, list_find_fn fn);
 void list_delete(list_t* self, list_delete_fn fn);
 void list_merge_contents_into(list_t* dst, list_t* src);
 
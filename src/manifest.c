@@ -0,0 +1,433 @@
+
+/*
+Copyright (c) 2005, IBM Corporation All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met: Redistributions of source code must retain the above
+copyright notice, this list of conditions and the following disclaimer.
+Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation
+and/or other materials provided with the distribution.  Neither the name
+of the IBM Corporation nor the names of its contributors may be used to
+endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "manifest.h"
+#include "vect.h"
+
+#define MANIFEST_MAGIC "ViewFSM\x01"
+#define MANIFEST_FORMAT 1
+
+#define MANIFEST_DIR 'd'
+#define MANIFEST_LINK 'f'
+
+/*
+Layout of a compiled Manifest, in native byte order:
+
+   magic[8] format:u32 node_count:u32 strings_size:u32 pad:u32
+   node_count nodes of manifestnode_t
+   strings_size bytes of names
+
+Node 0 is the root directory. Nodes are stored breadth first, so
+the children of a directory are contiguous, sorted by name, and
+always come after it.
+*/
+typedef struct manifestheader {
+   char magic[8];
+   uint32_t format;
+   uint32_t node_count;
+   uint32_t strings_size;
+   uint32_t pad;
+} manifestheader_t;
+
+typedef struct manifestnode {
+   uint32_t name;
+   uint32_t name_len;
+   uint32_t first;
+   uint32_t count;
+   uint32_t type;
+} manifestnode_t;
+
+static const char* manifest_map(const char* filename, size_t* size, struct stat* st) {
+   int fd = open(filename, O_RDONLY);
+   if (fd == -1)
+      return NULL;
+   if (fstat(fd, st) != 0 || st->st_size == 0) {
+      close(fd);
+      return NULL;
+   }
+   char* map = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (map == MAP_FAILED)
+      return NULL;
+   *size = st->st_size;
+   return map;
+}
+
+static void manifest_warn(entrydata_t* view, const char* path, int len) {
+   if (view)
+      fprintf(stderr, "viewfs: warning: %s/%s attempted to add %.*s as link (already directory)\n", view->u.view->package, view->u.view->version, len, path);
+   else
+      fprintf(stderr, "viewfs: warning: attempted to add %.*s as link (already directory)\n", len, path);
+}
+
+/*
+Inserts the entries of a text Manifest into the tree at root_node.
+The view may be NULL, to build a tree with links to no view.
+Links are allocated from the arena; directories, which the Manifests
+of other views may share, are allocated with malloc.
+Returns false if some line conflicted with the entries already in
+the tree, or had an empty path component.
+*/
+bool manifest_parse(const char* map, size_t size, entrydata_t* view, entrydata_t* root_node, arena_t* arena) {
+   bool consistent = true;
+   const char* end = map + size;
+   stringset_t* root = root_node->u.dir.entries;
+   const char* next;
+   // Directories of the previous path, and where each of them ends
+   // in it, so that lines sharing a prefix resume from there.
+   entrydata_t* cursor[PATH_MAX / 2];
+   int cursor_end[PATH_MAX / 2];
+   int depth = 0;
+   const char* prev = NULL;
+   // Lines and components are located with memchr, which the C
+   // library implements with SIMD, and passed to the tree as slices
+   // of the mapping.
+   for (const char* line = map; line < end; line = next) {
+      const char* newline = memchr(line, '\n', end - line);
+      next = newline ? newline + 1 : end;
+      int len = (newline ? newline : end) - line;
+      if (line[0] == '#' || next - line < 3 || len > PATH_MAX)
+         continue;
+      char type = line[0];
+      const char* path = line + 2;
+      const char* path_end = line + len;
+
+      int shared = 0;
+      int from = 0;
+      while (shared < depth && cursor_end[shared] < path_end - path
+             && path[cursor_end[shared]] == '/'
+             && memcmp(path + from, prev + from, cursor_end[shared] - from) == 0) {
+         from = cursor_end[shared] + 1;
+         shared++;
+      }
+      depth = shared;
+      prev = path;
+      entrydata_t* dir = depth ? cursor[depth - 1] : root_node;
+      stringset_t* tree = depth ? dir->u.dir.entries : root;
+      const char* word = path + from;
+      const char* slash;
+      while ( (slash = memchr(word, '/', path_end - word)) ) {
+         int wordlen = slash - word;
+         if (wordlen == 0)
+            consistent = false;
+         entrydata_t* entry = (entrydata_t*) stringset_get_n(tree, word, wordlen);
+         if (entry) {
+            if (entry->type == ET_DIR) {
+               dir = entry;
+               tree = entry->u.dir.entries;
+               if (!tree) {
+                  tree = stringset_new(NULL);
+                  entry->u.dir.entries = tree;
+               }
+            } else {
+               tree = NULL;
+               break;
+            }
+         } else {
+            stringset_t* newtree = stringset_new(NULL);
+            entry = entrydata_new(ET_DIR, newtree, dir, NULL);
+            entry->name = strndup(word, wordlen);
+            if (stringset_put_n(tree, word, wordlen, entry)) {
+               entrydata_count_subdir(dir, entry, 1);
+               dir = entry;
+               tree = newtree;
+            } else {
+               tree = NULL;
+               break;
+            }
+         }
+         if (view)
+            entrydata_touch_dir(dir, view);
+         if (depth < PATH_MAX / 2) {
+            cursor[depth] = dir;
+            cursor_end[depth] = slash - path;
+            depth++;
+         }
+         word = slash + 1;
+      }
+      if (!tree) {
+         consistent = false;
+         continue;
+      }
+      int wordlen = path_end - word;
+      if (wordlen == 0)
+         consistent = false;
+      switch (type) {
+      case 'd':
+         {
+            entrydata_t* entry = stringset_get_n(tree, word, wordlen);
+            if (!entry) {
+               entry = entrydata_new(ET_DIR, NULL, dir, NULL);
+               entry->name = strndup(word, wordlen);
+               if (stringset_put_n(tree, word, wordlen, entry))
+                  entrydata_count_subdir(dir, entry, 1);
+            } else if (entry->type != ET_DIR) {
+               consistent = false;
+               break;
+            }
+            if (view)
+               entrydata_touch_dir(entry, view);
+            break;
+         }
+      default:
+         {
+            entrydata_t* entry;
+            if ( (entry = stringset_get_n(tree, word, wordlen)) ) {
+               if (entry->type == ET_LINK && view) {
+                  entrydata_add_view_to_link(entry, view);
+                  entrydata_record(view, entry);
+               } else if (entry->type != ET_LINK) {
+                  manifest_warn(view, path, path_end - path);
+                  consistent = false;
+               }
+            } else {
+               entry = entrydata_new_in(arena, ET_LINK, view, dir, NULL);
+               entry->name = arena_strndup(arena, word, wordlen);
+               if (stringset_put_n(tree, word, wordlen, entry) && view)
+                  entrydata_record(view, entry);
+            }
+            break;
+         }
+      }
+   }
+   return consistent;
+}
+
+// ---------------------------------------------------------------------------
+
+static void manifest_merge(const manifestnode_t* nodes, const char* strings, const manifestnode_t* node, entrydata_t* dir, entrydata_t* view, arena_t* arena) {
+   for (uint32_t i = 0; i < node->count; i++) {
+      const manifestnode_t* child = &nodes[node->first + i];
+      const char* name = strings + child->name;
+      if (!dir->u.dir.entries)
+         dir->u.dir.entries = stringset_new(NULL);
+      entrydata_t* entry = stringset_get_n(dir->u.dir.entries, name, child->name_len);
+      if (child->type == MANIFEST_DIR) {
+         if (!entry) {
+            entry = entrydata_new(ET_DIR, child->count ? stringset_new(NULL) : NULL, dir, NULL);
+            entry->name = strndup(name, child->name_len);
+            stringset_put_n(dir->u.dir.entries, name, child->name_len, entry);
+            entrydata_count_subdir(dir, entry, 1);
+         }
+         if (entry->type == ET_DIR) {
+            entrydata_touch_dir(entry, view);
+            manifest_merge(nodes, strings, child, entry, view, arena);
+         }
+      } else if (entry) {
+         if (entry->type == ET_LINK) {
+            entrydata_add_view_to_link(entry, view);
+            entrydata_record(view, entry);
+         } else {
+            char path[PATH_MAX];
+            int len = entrydata_path(dir, path, PATH_MAX);
+            if (len >= 0)
+               len += snprintf(path + len, PATH_MAX - len, "%s%.*s", len ? "/" : "", (int) child->name_len, name);
+            manifest_warn(view, path, len < PATH_MAX ? len : PATH_MAX - 1);
+         }
+      } else {
+         entry = entrydata_new_in(arena, ET_LINK, view, dir, NULL);
+         entry->name = arena_strndup(arena, name, child->name_len);
+         stringset_put_n(dir->u.dir.entries, name, child->name_len, entry);
+         entrydata_record(view, entry);
+      }
+   }
+}
+
+/*
+Checks that all offsets of a compiled Manifest are in bounds, and
+that every directory only refers to nodes after it.
+*/
+static bool manifest_validate(const char* map, size_t size) {
+   if (size < sizeof(manifestheader_t))
+      return false;
+   const manifestheader_t* header = (const manifestheader_t*) map;
+   if (memcmp(header->magic, MANIFEST_MAGIC, 8) != 0 || header->format != MANIFEST_FORMAT || header->node_count == 0)
+      return false;
+   uint64_t nodes_size = (uint64_t) header->node_count * sizeof(manifestnode_t);
+   if (sizeof(manifestheader_t) + nodes_size + header->strings_size != size)
+      return false;
+   const manifestnode_t* nodes = (const manifestnode_t*) (map + sizeof(manifestheader_t));
+   for (uint32_t i = 0; i < header->node_count; i++) {
+      const manifestnode_t* node = &nodes[i];
+      if ((uint64_t) node->name + node->name_len > header->strings_size || (node->name_len == 0 && i > 0))
+         return false;
+      if (node->type == MANIFEST_DIR) {
+         if (node->count && (node->first <= i || (uint64_t) node->first + node->count > header->node_count))
+            return false;
+      } else if (node->type != MANIFEST_LINK || node->count || i == 0) {
+         return false;
+      }
+   }
+   return nodes[0].type == MANIFEST_DIR;
+}
+
+static int64_t manifest_mtime(const struct stat* st) {
+   return (int64_t) st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+/*
+Inserts the entries of the Manifest of a view into the tree at
+root_node, from the compiled Manifest if it is at least as recent
+as the text one. Records the mtime of the text Manifest in the view.
+Returns false if the view has no Manifest.
+*/
+bool manifest_load(const char* dirname, entrydata_t* view, entrydata_t* root_node) {
+   char* filename;
+   struct stat st;
+   size_t size;
+   asprintf(&filename, "%s/%s", dirname, MANIFEST_FILE);
+   const char* map = manifest_map(filename, &size, &st);
+   free(filename);
+   if (!map)
+      return false;
+   view->u.view->mtime = manifest_mtime(&st);
+   if (!view->u.view->arena)
+      view->u.view->arena = arena_new();
+   arena_t* arena = view->u.view->arena;
+
+   struct stat bin_st;
+   size_t bin_size;
+   asprintf(&filename, "%s/%s", dirname, COMPILED_MANIFEST_FILE);
+   const char* bin = NULL;
+   if (stat(filename, &bin_st) == 0 && manifest_mtime(&bin_st) >= view->u.view->mtime)
+      bin = manifest_map(filename, &bin_size, &bin_st);
+   if (bin && manifest_validate(bin, bin_size)) {
+      const manifestheader_t* header = (const manifestheader_t*) bin;
+      const manifestnode_t* nodes = (const manifestnode_t*) (bin + sizeof(manifestheader_t));
+      const char* strings = (const char*) (nodes + header->node_count);
+      manifest_merge(nodes, strings, &nodes[0], root_node, view, arena);
+   } else {
+      if (bin)
+         fprintf(stderr, "viewfs: ignoring corrupted %s\n", filename);
+      madvise((void*) map, size, MADV_SEQUENTIAL);
+      manifest_parse(map, size, view, root_node, arena);
+   }
+   free(filename);
+   if (bin)
+      munmap((void*) bin, bin_size);
+   munmap((void*) map, size);
+   return true;
+}
+
+// ---------------------------------------------------------------------------
+
+static int manifest_compare_names(const void* a, const void* b) {
+   const entrydata_t* x = *(entrydata_t* const*) a;
+   const entrydata_t* y = *(entrydata_t* const*) b;
+   return strcmp(x->name, y->name);
+}
+
+/*
+Compiles a text Manifest into a file that manifest_load can merge
+directly. The output is written to a temporary file and renamed.
+Manifests that list a path both as a file and as a directory, or
+have empty path components, are not compiled: their entries depend
+on what other packages put in the tree, so they are only loaded
+line by line.
+*/
+bool manifest_compile(const char* manifest, const char* output) {
+   struct stat st;
+   size_t size;
+   const char* map = manifest_map(manifest, &size, &st);
+   if (!map)
+      return false;
+   arena_t* arena = arena_new();
+   entrydata_t* root = entrydata_new(ET_DIR, stringset_new(NULL), NULL, NULL);
+   bool ok = manifest_parse(map, size, NULL, root, arena);
+   munmap((void*) map, size);
+
+   // Lay out the tree breadth first; order[i] is the entry of node i.
+   vect_t* order = vect_new(1024);
+   vect_t* children = vect_new(64);
+   manifestnode_t* nodes = malloc(sizeof(manifestnode_t));
+   int64_t node_count = 1;
+   uint32_t strings_size = 0;
+   nodes[0] = (manifestnode_t) { 0, 0, 0, 0, MANIFEST_DIR };
+   vect_add(order, root);
+   for (int64_t i = 0; i < order->used; i++) {
+      entrydata_t* dir = order->array[i];
+      if (dir->type != ET_DIR || !dir->u.dir.entries)
+         continue;
+      children->used = 0;
+      stringset_begin_iterate(entrydata_t, entry, dir->u.dir.entries);
+         vect_add(children, entry);
+      stringset_end_iterate(entry);
+      qsort(children->array, children->used, sizeof(entrydata_t*), manifest_compare_names);
+      nodes[i].first = node_count;
+      nodes[i].count = children->used;
+      node_count += children->used;
+      nodes = realloc(nodes, node_count * sizeof(manifestnode_t));
+      for (int64_t j = 0; j < children->used; j++) {
+         entrydata_t* entry = children->array[j];
+         manifestnode_t* node = &nodes[nodes[i].first + j];
+         node->name = strings_size;
+         node->name_len = strlen(entry->name);
+         node->first = 0;
+         node->count = 0;
+         node->type = entry->type == ET_DIR ? MANIFEST_DIR : MANIFEST_LINK;
+         strings_size += node->name_len;
+         vect_add(order, entry);
+      }
+   }
+
+   char* tmpname;
+   asprintf(&tmpname, "%s.tmp", output);
+   FILE* f = ok ? fopen(tmpname, "w") : NULL;
+   ok = (f != NULL);
+   if (f) {
+      manifestheader_t header = { MANIFEST_MAGIC, MANIFEST_FORMAT, node_count, strings_size, 0 };
+      fwrite(&header, sizeof(header), 1, f);
+      fwrite(nodes, sizeof(manifestnode_t), node_count, f);
+      for (int64_t i = 1; i < order->used; i++) {
+         entrydata_t* entry = order->array[i];
+         fwrite(entry->name, 1, nodes[i].name_len, f);
+      }
+      ok = (fclose(f) == 0);
+   }
+   if (ok)
+      ok = (rename(tmpname, output) == 0);
+   else if (f)
+      unlink(tmpname);
+   free(tmpname);
+   free(nodes);
+   vect_delete(children);
+   vect_delete(order);
+   entrydata_delete(root);
+   arena_delete(arena);
+   return ok;
+}
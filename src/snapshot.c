@@ -0,0 +1,493 @@
+
+/*
+Copyright (c) 2005, IBM Corporation All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met: Redistributions of source code must retain the above
+copyright notice, this list of conditions and the following disclaimer.
+Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation
+and/or other materials provided with the distribution.  Neither the name
+of the IBM Corporation nor the names of its contributors may be used to
+endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "snapshot.h"
+#include "depfile.h"
+#include "vect.h"
+
+#define SNAPSHOT_MAGIC "ViewFS\x01"
+#define SNAPSHOT_FORMAT 1
+
+#define SNAPSHOT_END 0xff
+
+/*
+Layout, in native byte order (a snapshot is a local cache):
+
+   magic[8] format:u32 size:u64 watch_dir:str
+   package_count:u32
+   for each package:
+      name:str version_count:u32
+      for each version:
+         version:str manifest_mtime:i64 deps_mtime:i64 rule_count:i32
+         for each rule (rule_count is -1 if there was no file,
+         and -2 if it had not been parsed yet):
+            name:str constraint_count:u32
+            for each constraint: kind:u32 version:str
+   tree, as a directory:
+      for each entry: type:u8 name:str, then
+         ET_LINK: view_count:u32 view:u32...
+         ET_DIR: a directory
+      SNAPSHOT_END:u8
+
+Strings are a u32 length followed by the bytes and a '\0',
+so that they can be used in place from the mapped file.
+Views are numbered in the order they appear in the packages.
+*/
+
+static int64_t snapshot_mtime(const char* watch_dir, const char* package, const char* version, const char* file) {
+   char* filename;
+   asprintf(&filename, "%s/%s/%s/%s", watch_dir, package, version, file);
+   struct stat st;
+   int res = stat(filename, &st);
+   free(filename);
+   if (res != 0)
+      return 0;
+   return (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+}
+
+// ---------------------------------------------------------------------------
+
+static inline void put_u8(FILE* f, uint8_t v) { fwrite(&v, sizeof(v), 1, f); }
+static inline void put_u32(FILE* f, uint32_t v) { fwrite(&v, sizeof(v), 1, f); }
+static inline void put_i32(FILE* f, int32_t v) { fwrite(&v, sizeof(v), 1, f); }
+static inline void put_i64(FILE* f, int64_t v) { fwrite(&v, sizeof(v), 1, f); }
+
+static inline void put_str(FILE* f, const char* s) {
+   uint32_t len = strlen(s);
+   put_u32(f, len);
+   fwrite(s, 1, len + 1, f);
+}
+
+/*
+Saves the dependency rules of a view, if they were already parsed;
+the others are parsed when needed after the snapshot is loaded.
+*/
+static void snapshot_save_rules(FILE* f, list_t* rules, bool exists) {
+   if (!exists || !rules) {
+      put_i32(f, exists ? -2 : -1);
+      return;
+   }
+   int32_t count = 0;
+   for (listitem_t* at = rules->hd; at; at = at->next)
+      count++;
+   put_i32(f, count);
+   list_foreach(dep_t, rule, rules) {
+      uint32_t constraint_count = 0;
+      for (listitem_t* at = rule->constraints->hd; at; at = at->next)
+         constraint_count++;
+      put_str(f, rule->name);
+      put_u32(f, constraint_count);
+      list_foreach(constraint_t, constraint, rule->constraints) {
+         put_u32(f, constraint->kind);
+         put_str(f, constraint->version);
+      }
+   }
+}
+
+static void snapshot_save_dir(FILE* f, entrydata_t* dir, uint32_t* positions) {
+   if (dir->u.dir.entries) {
+      stringset_begin_iterate(entrydata_t, entry, dir->u.dir.entries);
+         put_u8(f, entry->type);
+         put_str(f, entry_key);
+         if (entry->type == ET_LINK) {
+            uint32_t count = 0;
+            while (entry->u.link.view[count])
+               count++;
+            put_u32(f, count);
+            for (uint32_t i = 0; i < count; i++)
+               put_u32(f, positions[entry->u.link.view[i]->u.view->index]);
+         } else {
+            snapshot_save_dir(f, entry, positions);
+         }
+      stringset_end_iterate(entry);
+   }
+   put_u8(f, SNAPSHOT_END);
+}
+
+bool snapshot_save(const char* filename, const char* watch_dir, entrydata_t* packages_root, entrydata_t* tree_root) {
+   uint32_t package_count = 0;
+   int max_index = -1;
+   bool complete = true;
+   stringset_begin_iterate(entrydata_t, package, packages_root->u.dir.entries);
+      package_count++;
+      if (!package->u.dir.entries)
+         continue;
+      stringset_begin_iterate(entrydata_t, view, package->u.dir.entries);
+         if (!view->u.view->loaded)
+            complete = false;
+         if (view->u.view->index > max_index)
+            max_index = view->u.view->index;
+      stringset_end_iterate(view);
+   stringset_end_iterate(package);
+   if (!complete)
+      return false;
+
+   char* tmpname;
+   asprintf(&tmpname, "%s.tmp", filename);
+   FILE* f = fopen(tmpname, "w");
+   if (!f) {
+      fprintf(stderr, "viewfs: could not write snapshot %s\n", tmpname);
+      free(tmpname);
+      return false;
+   }
+   uint32_t* positions = calloc(max_index + 2, sizeof(uint32_t));
+   uint32_t position = 0;
+
+   fwrite(SNAPSHOT_MAGIC, 1, 8, f);
+   put_u32(f, SNAPSHOT_FORMAT);
+   put_i64(f, 0);
+   put_str(f, watch_dir);
+   put_u32(f, package_count);
+   stringset_begin_iterate(entrydata_t, package, packages_root->u.dir.entries);
+      put_str(f, package_key);
+      if (!package->u.dir.entries) {
+         put_u32(f, 0);
+         continue;
+      }
+      uint32_t version_count = 0;
+      stringset_begin_iterate(entrydata_t, view, package->u.dir.entries);
+         version_count++;
+      stringset_end_iterate(view);
+      put_u32(f, version_count);
+      stringset_begin_iterate(entrydata_t, view, package->u.dir.entries);
+         viewdata_t* data = view->u.view;
+         int64_t deps_mtime = snapshot_mtime(watch_dir, data->package, data->version, DEPENDENCIES_FILE);
+         put_str(f, view_key);
+         put_i64(f, data->mtime);
+         put_i64(f, deps_mtime);
+         snapshot_save_rules(f, data->dep_rules, deps_mtime != 0);
+         positions[data->index] = position++;
+      stringset_end_iterate(view);
+   stringset_end_iterate(package);
+
+   snapshot_save_dir(f, tree_root, positions);
+   free(positions);
+
+   int64_t size = ftell(f);
+   fseek(f, 8 + sizeof(uint32_t), SEEK_SET);
+   put_i64(f, size);
+   bool ok = (fclose(f) == 0);
+   if (ok)
+      ok = (rename(tmpname, filename) == 0);
+   if (!ok) {
+      fprintf(stderr, "viewfs: could not write snapshot %s\n", filename);
+      unlink(tmpname);
+   }
+   free(tmpname);
+   return ok;
+}
+
+// ---------------------------------------------------------------------------
+
+typedef struct reader {
+   const char* at;
+   const char* end;
+   bool ok;
+} reader_t;
+
+static inline bool get_bytes(reader_t* r, void* out, size_t size) {
+   if (!r->ok || (size_t) (r->end - r->at) < size) {
+      r->ok = false;
+      memset(out, 0, size);
+      return false;
+   }
+   memcpy(out, r->at, size);
+   r->at += size;
+   return true;
+}
+
+static inline uint8_t get_u8(reader_t* r) { uint8_t v; get_bytes(r, &v, sizeof(v)); return v; }
+static inline uint32_t get_u32(reader_t* r) { uint32_t v; get_bytes(r, &v, sizeof(v)); return v; }
+static inline int32_t get_i32(reader_t* r) { int32_t v; get_bytes(r, &v, sizeof(v)); return v; }
+static inline int64_t get_i64(reader_t* r) { int64_t v; get_bytes(r, &v, sizeof(v)); return v; }
+
+static inline char* get_str(reader_t* r) {
+   uint32_t len = get_u32(r);
+   if (!r->ok || r->end - r->at < (int64_t) len + 1 || r->at[len] != '\0') {
+      r->ok = false;
+      return "";
+   }
+   char* s = (char*) r->at;
+   r->at += len + 1;
+   return s;
+}
+
+static list_t* snapshot_load_rules(reader_t* r, bool* missing) {
+   int32_t count = get_i32(r);
+   *missing = (count == -1);
+   if (count < 0)
+      return NULL;
+   list_t* rules = list_new();
+   for (int i = 0; i < count && r->ok; i++) {
+      dep_t* rule = dep_new(get_str(r));
+      uint32_t constraint_count = get_u32(r);
+      for (uint32_t j = 0; j < constraint_count && r->ok; j++) {
+         relation_t kind = get_u32(r);
+         dep_add_constraint(rule, kind, get_str(r));
+      }
+      list_put(rules, 0, rule);
+   }
+   return rules;
+}
+
+static void snapshot_skip_rules(reader_t* r) {
+   int32_t count = get_i32(r);
+   for (int i = 0; i < count && r->ok; i++) {
+      get_str(r);
+      uint32_t constraint_count = get_u32(r);
+      for (uint32_t j = 0; j < constraint_count && r->ok; j++) {
+         get_u32(r);
+         get_str(r);
+      }
+   }
+}
+
+static int snapshot_count_dir(const char* dirname) {
+   DIR* d = opendir(dirname);
+   if (!d)
+      return -1;
+   int count = 0;
+   struct dirent* ent;
+   while ( (ent = readdir(d)) ) {
+      if (ent->d_name[0] != '.')
+         count++;
+   }
+   closedir(d);
+   return count;
+}
+
+static bool snapshot_exists(const char* watch_dir, const char* package, const char* version) {
+   char* filename;
+   if (version)
+      asprintf(&filename, "%s/%s/%s", watch_dir, package, version);
+   else
+      asprintf(&filename, "%s/%s", watch_dir, package);
+   bool exists = (access(filename, F_OK) == 0);
+   free(filename);
+   return exists;
+}
+
+/*
+Checks the packages section against the watch directory.
+Every package and version must still be there, with no new ones,
+and their Manifest and Dependencies files must be unchanged.
+Since the counts match, finding each of them is enough to tell
+that none was replaced by another.
+*/
+static bool snapshot_validate(reader_t* r, const char* watch_dir, uint32_t* view_count) {
+   uint32_t package_count = get_u32(r);
+   int count = snapshot_count_dir(watch_dir);
+   if (count < 0 || (uint32_t) count != package_count)
+      return false;
+   *view_count = 0;
+   for (uint32_t i = 0; i < package_count && r->ok; i++) {
+      char* package = get_str(r);
+      uint32_t version_count = get_u32(r);
+      char* dirname;
+      asprintf(&dirname, "%s/%s", watch_dir, package);
+      count = snapshot_count_dir(dirname);
+      free(dirname);
+      // A package that is not a directory has no versions.
+      if (count == -1 && version_count == 0 && snapshot_exists(watch_dir, package, NULL))
+         count = 0;
+      if (count < 0 || (uint32_t) count != version_count)
+         return false;
+      for (uint32_t j = 0; j < version_count && r->ok; j++) {
+         char* version = get_str(r);
+         int64_t manifest_mtime = get_i64(r);
+         int64_t deps_mtime = get_i64(r);
+         if (snapshot_mtime(watch_dir, package, version, MANIFEST_FILE) != manifest_mtime
+          || snapshot_mtime(watch_dir, package, version, DEPENDENCIES_FILE) != deps_mtime)
+            return false;
+         if (!manifest_mtime && !deps_mtime && !snapshot_exists(watch_dir, package, version))
+            return false;
+         snapshot_skip_rules(r);
+         (*view_count)++;
+      }
+   }
+   return r->ok;
+}
+
+static void snapshot_load_packages(reader_t* r, stringset_t* packages, entrydata_t** views) {
+   uint32_t package_count = get_u32(r);
+   int v = 0;
+   for (uint32_t i = 0; i < package_count && r->ok; i++) {
+      char* package = get_str(r);
+      uint32_t version_count = get_u32(r);
+      entrydata_t* package_node = entrydata_new(ET_DIR, NULL, NULL, package);
+      stringset_put(packages, package, package_node);
+      for (uint32_t j = 0; j < version_count && r->ok; j++) {
+         char* version = get_str(r);
+         entrydata_t* view = entrydata_new(ET_VIEW, package, version);
+         entrydata_add_version(package_node, version, view);
+         view->u.view->loaded = true;
+         view->u.view->mtime = get_i64(r);
+         get_i64(r);
+         view->u.view->dep_rules = snapshot_load_rules(r, &view->u.view->no_dependencies);
+         views[v++] = view;
+      }
+   }
+}
+
+static void snapshot_load_dir(reader_t* r, entrydata_t* dir, int depth, entrydata_t** views, uint32_t view_count) {
+   while (r->ok) {
+      uint8_t type = get_u8(r);
+      if (type == SNAPSHOT_END)
+         break;
+      char* name = get_str(r);
+      if (depth >= PATH_MAX / 2) {
+         r->ok = false;
+         break;
+      }
+      entrydata_t* entry;
+      if (type == ET_LINK) {
+         uint32_t count = get_u32(r);
+         if (count == 0 || count > view_count) {
+            r->ok = false;
+            break;
+         }
+         entry = entrydata_new(ET_LINK, NULL, dir, name);
+         entry->u.link.view = realloc(entry->u.link.view, sizeof(entrydata_t*) * (count + 1));
+         for (uint32_t i = 0; i < count; i++) {
+            uint32_t at = get_u32(r);
+            entry->u.link.view[i] = at < view_count ? views[at] : NULL;
+            if (at >= view_count)
+               r->ok = false;
+         }
+         entry->u.link.view[count] = NULL;
+      } else if (type == ET_DIR) {
+         entry = entrydata_new(ET_DIR, NULL, dir, name);
+         snapshot_load_dir(r, entry, depth + 1, views, view_count);
+      } else {
+         r->ok = false;
+         break;
+      }
+      entrydata_add_subentry(dir, name, entry);
+   }
+}
+
+/*
+Rebuilds what each view touched in the tree, as manifest_load does:
+the links with the view, and the directories above them.
+*/
+static void snapshot_record_links(entrydata_t* dir) {
+   if (!dir->u.dir.entries)
+      return;
+   stringset_begin_iterate(entrydata_t, entry, dir->u.dir.entries);
+      if (entry->type == ET_LINK) {
+         for (int i = 0; entry->u.link.view[i]; i++)
+            entrydata_record(entry->u.link.view[i], entry);
+      } else {
+         snapshot_record_links(entry);
+      }
+   stringset_end_iterate(entry);
+}
+
+static void snapshot_record_dirs(entrydata_t* view, entrydata_t* tree_root) {
+   vect_t* touched = view->u.view->touched;
+   if (!touched)
+      return;
+   int64_t links = touched->used;
+   for (int64_t i = 0; i < links; i++) {
+      entrydata_t* link = touched->array[i];
+      for (entrydata_t* dir = link->parent; dir != tree_root && dir->u.dir.last_view != view->u.view->index; dir = dir->parent)
+         entrydata_touch_dir(dir, view);
+   }
+}
+
+bool snapshot_load(const char* filename, const char* watch_dir, entrydata_t* packages_root, entrydata_t* tree_root) {
+   int fd = open(filename, O_RDONLY);
+   if (fd == -1)
+      return false;
+   struct stat st;
+   if (fstat(fd, &st) != 0 || st.st_size < (off_t) (8 + sizeof(uint32_t) + sizeof(int64_t))) {
+      close(fd);
+      return false;
+   }
+   char* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (map == MAP_FAILED)
+      return false;
+
+   reader_t r = { map, map + st.st_size, true };
+   bool ok = (memcmp(map, SNAPSHOT_MAGIC, 8) == 0);
+   r.at += 8;
+   ok = ok && get_u32(&r) == SNAPSHOT_FORMAT;
+   ok = ok && get_i64(&r) == st.st_size;
+   ok = ok && strcmp(get_str(&r), watch_dir) == 0;
+   const char* packages_at = r.at;
+   uint32_t view_count = 0;
+   ok = ok && snapshot_validate(&r, watch_dir, &view_count);
+   if (!ok) {
+      munmap(map, st.st_size);
+      return false;
+   }
+
+   stringset_t* packages = stringset_new(NULL);
+   entrydata_t* tree = entrydata_new(ET_DIR, stringset_new(NULL), NULL, NULL);
+   entrydata_t** views = calloc(view_count + 1, sizeof(entrydata_t*));
+   r.at = packages_at;
+   snapshot_load_packages(&r, packages, views);
+   snapshot_load_dir(&r, tree, 0, views, view_count);
+   ok = r.ok && r.at == r.end;
+   munmap(map, st.st_size);
+
+   if (!ok) {
+      free(views);
+      fprintf(stderr, "viewfs: ignoring corrupted snapshot %s\n", filename);
+      stringset_delete(packages, entrydata_delete);
+      entrydata_delete(tree);
+      return false;
+   }
+   stringset_delete(packages_root->u.dir.entries, entrydata_delete);
+   packages_root->u.dir.entries = packages;
+   packages_root->subdirs = packages->count;
+   stringset_delete(tree_root->u.dir.entries, entrydata_delete);
+   tree_root->u.dir.entries = tree->u.dir.entries;
+   tree_root->subdirs = tree->subdirs;
+   stringset_begin_iterate(entrydata_t, entry, tree_root->u.dir.entries);
+      entry->parent = tree_root;
+   stringset_end_iterate(entry);
+   free(tree);
+   snapshot_record_links(tree_root);
+   for (uint32_t i = 0; i < view_count; i++)
+      snapshot_record_dirs(views[i], tree_root);
+   free(views);
+   return true;
+}
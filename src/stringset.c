@@ -36,140 +36,193 @@ Hisham Muhammad, 2005/04/07.
 #include <stddef.h>
 #include <limits.h>
 #include <stdlib.h>
-#include <string.h>
+#include <strings.h>
 #include <assert.h>
 #include <stdbool.h>
 #include <ctype.h>
 
 #include <stdio.h>
 
-#ifndef MIN
-#define MIN(a,b) ((a)<(b)?(a):(b))
-#endif
-
-#ifndef MAX
-#define MAX(a,b) ((a)>(b)?(a):(b))
-#endif
-
 int stringset_debug = 0;
 
 stringset_t* stringset_debug_root;
 
+static inline int size_class(int n) {
+   if (n == 0)
+      return 0;
+   int capacity = 2;
+   while (capacity < n)
+      capacity *= 2;
+   return capacity;
+}
+
+static stringset_node_t* node_new(const char* label, int label_len, int capacity, void* value) {
+   stringset_node_t* node = malloc(sizeof(stringset_node_t) + capacity * (sizeof(stringset_node_t*) + 1) + label_len);
+   node->value = value;
+   node->label_len = label_len;
+   node->capacity = capacity;
+   node->nchildren = 0;
+   if (label)
+      memcpy(stringset_node_label(node), label, label_len);
+   return node;
+}
+
+/*
+Returns the index of the child whose label starts with ch, or -1.
+*/
+static inline int node_find_child(stringset_node_t* node, unsigned char ch) {
+   unsigned char* firsts = stringset_node_firsts(node);
+   int n = node->nchildren;
+   if (n <= 8) {
+      for (int i = 0; i < n; i++)
+         if (firsts[i] == ch)
+            return i;
+      return -1;
+   }
+   int lo = 0, hi = n - 1;
+   while (lo <= hi) {
+      int mid = (lo + hi) / 2;
+      if (firsts[mid] < ch)
+         lo = mid + 1;
+      else if (firsts[mid] > ch)
+         hi = mid - 1;
+      else
+         return mid;
+   }
+   return -1;
+}
+
+/*
+Adds a child, moving the node to the next size class if it is full.
+Returns the node, which may have been reallocated.
+*/
+static stringset_node_t* node_add_child(stringset_node_t* node, stringset_node_t* child) {
+   if (node->nchildren == node->capacity) {
+      stringset_node_t* grown = node_new(stringset_node_label(node), node->label_len, size_class(node->capacity + 1), node->value);
+      grown->nchildren = node->nchildren;
+      memcpy(stringset_node_children(grown), stringset_node_children(node), node->nchildren * sizeof(stringset_node_t*));
+      memcpy(stringset_node_firsts(grown), stringset_node_firsts(node), node->nchildren);
+      free(node);
+      node = grown;
+   }
+   stringset_node_t** children = stringset_node_children(node);
+   unsigned char* firsts = stringset_node_firsts(node);
+   unsigned char ch = stringset_node_label(child)[0];
+   int at = node->nchildren;
+   while (at > 0 && firsts[at - 1] > ch) {
+      children[at] = children[at - 1];
+      firsts[at] = firsts[at - 1];
+      at--;
+   }
+   children[at] = child;
+   firsts[at] = ch;
+   node->nchildren++;
+   return node;
+}
+
+static void node_remove_child(stringset_node_t* node, int at) {
+   stringset_node_t** children = stringset_node_children(node);
+   unsigned char* firsts = stringset_node_firsts(node);
+   int rest = node->nchildren - at - 1;
+   memmove(children + at, children + at + 1, rest * sizeof(stringset_node_t*));
+   memmove(firsts + at, firsts + at + 1, rest);
+   node->nchildren--;
+}
+
+/*
+Replaces a valueless node that has a single child by one node
+holding both labels.
+*/
+static stringset_node_t* node_merge_child(stringset_node_t* node) {
+   stringset_node_t* child = stringset_node_children(node)[0];
+   stringset_node_t* merged = node_new(NULL, node->label_len + child->label_len, child->capacity, child->value);
+   memcpy(stringset_node_label(merged), stringset_node_label(node), node->label_len);
+   memcpy(stringset_node_label(merged) + node->label_len, stringset_node_label(child), child->label_len);
+   merged->nchildren = child->nchildren;
+   memcpy(stringset_node_children(merged), stringset_node_children(child), child->nchildren * sizeof(stringset_node_t*));
+   memcpy(stringset_node_firsts(merged), stringset_node_firsts(child), child->nchildren);
+   free(node);
+   free(child);
+   return merged;
+}
+
+static void node_delete(stringset_node_t* node, stringset_delete_fn_t destroy_value) {
+   for (int i = 0; i < node->nchildren; i++)
+      node_delete(stringset_node_children(node)[i], destroy_value);
+   if (node->value && destroy_value)
+      destroy_value(node->value);
+   free(node);
+}
+
 stringset_t* stringset_new(void* value) {
    stringset_t* self = malloc(sizeof(stringset_t));
-   self->value = value;
-   self->min = 0;
-   self->max = 0;
-   self->u.leafkey = NULL;
+   self->root = node_new(NULL, 0, 0, value);
    self->count = 0;
+   self->generation = 0;
    return self;
 }
 
 void stringset_delete(stringset_t* self, stringset_delete_fn_t destroy_value) {
-   if (self->min == -1) {
-      free(self->u.leafkey);
-   } else if (self->min > 0) {
-      for (int i = self->min; i <= self->max; i++)
-         if (self->u.links[i - self->min])
-            stringset_delete(self->u.links[i - self->min], destroy_value);
-   }
-   destroy_value(self->value);
+   node_delete(self->root, destroy_value);
    free(self);
 }
 
-#define is_leaf(self) (((self)->min == 1) && ((self)->max == 0))
-#define has_links(self) ((self)->max > 0)
-
-#define set_leaf(self) do { (self)->min = 1; (self)->max = 0; } while (0)
-
-void stringset_debug_show(stringset_t* self) {
-   fprintf(stderr, "{--------------------------\n");
-   if (is_leaf(self))
-      fprintf(stderr, "[%p] leaf \"%s\" -> %p\n", self, self->u.leafkey, self->value);
-   else
-      fprintf(stderr, "[%p] '%c'-'%c' $-> %p\n", self, self->min, self->max, self->value);
-   if (has_links(self)) {
-      for (int i = self->min; i <= self->max; i++) {
-         if (self->u.links[i - self->min]) {
-            fprintf(stderr, "%c:%p ", i, self->u.links[i - self->min]);
-         }
-      }
-      fprintf(stderr, "\n");
-   }
-   fprintf(stderr, "}--------------------------\n");
-   if (has_links(self)) {
-      for (int i = self->min; i <= self->max; i++) {
-         if (self->u.links[i - self->min]) {
-            stringset_debug_show(self->u.links[i - self->min]);
-         }
-      }
-   }
+bool stringset_put(stringset_t* self, const char* key, void* value) {
+   assert(key);
+   return stringset_put_n(self, key, strlen(key), value);
 }
 
-static bool stringset_put_rec(stringset_t* self, const char* key, void* value, stringset_t* root) {
-   assert(self);
-   assert(key);
-   char ch = key[0];
-   if (is_leaf(self)) {
-      if (strcmp(self->u.leafkey, key) == 0) {
-         //fprintf(stderr, "Already exists.\n");
-         return false;
-      } else {
-         stringset_t* leaf = stringset_new(self->value);
-         if (self->u.leafkey[1] != '\0') {
-            leaf->u.leafkey = strdup(self->u.leafkey + 1);
-            set_leaf(leaf);
-         }
-         self->min = self->u.leafkey[0];
-         self->max = self->u.leafkey[0];
-         free(self->u.leafkey);
-         self->u.leafkey = NULL;
-         self->u.links = calloc(1, sizeof(stringset_t*));
-         self->u.links[0] = leaf;
-         self->value = NULL;
+/*
+Like stringset_put, for a key of len bytes that need not be
+NUL-terminated.
+*/
+bool stringset_put_n(stringset_t* self, const char* key, int len, void* value) {
+   stringset_node_t** slot = &self->root;
+   while (true) {
+      stringset_node_t* node = *slot;
+      char* label = stringset_node_label(node);
+      int common = 0;
+      while (common < node->label_len && common < len && key[common] == label[common])
+         common++;
+      if (common < node->label_len) {
+         stringset_node_t* split = node_new(label, common, 2, NULL);
+         memmove(label, label + common, node->label_len - common);
+         node->label_len -= common;
+         split = node_add_child(split, node);
+         if (common == len)
+            split->value = value;
+         else
+            split = node_add_child(split, node_new(key + common, len - common, 0, value));
+         *slot = split;
+         self->count++;
+         self->generation++;
+         return true;
       }
-   }
-   assert(!is_leaf(self));
-   if (key[0] == '\0') {
-      //fprintf(stderr, "Already exists.\n");
-      if (self->value)
-         return false;
-      self->value = value;
-      root->count++;
-      return true;
-   }
-   if (!(has_links(self)) && !(self->value)) {
-      self->u.leafkey = strdup(key);
-      set_leaf(self);
-      self->value = value;
-      root->count++;
-      return true;
-   }
-   if (ch < self->min || ch > self->max) {
-      int newmin = self->min == 0 ? ch : MIN(ch, self->min);
-      int newmax = self->max == 0 ? ch : MAX(ch, self->max);
-      stringset_t** newlinks = calloc(newmax - newmin + 1, sizeof(stringset_t*));
-      if (self->u.links) {
-         memcpy(newlinks + (self->min - newmin), self->u.links, sizeof(stringset_t*) * (self->max - self->min + 1));
-         free(self->u.links);
+      key += common;
+      len -= common;
+      if (len == 0) {
+         if (node->value)
+            return false;
+         node->value = value;
+         self->count++;
+         self->generation++;
+         return true;
       }
-      self->min = newmin;
-      self->max = newmax;
-      self->u.links = newlinks;
+      int at = node_find_child(node, key[0]);
+      if (at == -1) {
+         *slot = node_add_child(node, node_new(key, len, 0, value));
+         self->count++;
+         self->generation++;
+         return true;
+      }
+      slot = &(stringset_node_children(node)[at]);
    }
-   if (self->u.links[ch - self->min] == NULL)
-      self->u.links[ch - self->min] = stringset_new( NULL );
-   return stringset_put_rec(self->u.links[ch - self->min], key + 1, value, root);
 }
 
 bool stringset_put_int(stringset_t* self, int ikey, void* value) {
    char key[32];
    snprintf(key, 31, "%d", ikey);
-   return stringset_put_rec(self, key, value, self);
-}
-
-bool stringset_put(stringset_t* self, const char* key, void* value) {
-   return stringset_put_rec(self, key, value, self);
+   return stringset_put(self, key, value);
 }
 
 bool stringset_remove_int(stringset_t* self, int ikey, void** removed_value) {
@@ -181,85 +234,43 @@ bool stringset_remove_int(stringset_t* self, int ikey, void** removed_value) {
 bool stringset_remove(stringset_t* self, const char* key, void** removed_value) {
    if (removed_value)
       *removed_value = NULL;
-   bool remove_this = false;
-   char ch = key[0];
-   if (is_leaf(self)) {
-      if (strcmp(self->u.leafkey, key) == 0) {
-         if (removed_value)
-            *removed_value = self->value;
-         free(self->u.leafkey);
-         self->min = 0;
-         self->max = 0;
-         self->value = NULL;
-         remove_this = true;
-      } else {
-         /* Key not in tree. */
-      }
-   } else {
-      int index = ch - self->min;
-      if (ch == '\0') {
-         if (removed_value)
-            removed_value = self->value;
-         self->value = NULL;
-         if (!has_links(self)) {
-            self->min = 0;
-            self->max = 0;
-            self->value = NULL;
-            remove_this = true;
-         }
-      } else if (!has_links(self) || ch < self->min || ch > self->max) {
-         /* Key not in tree. */
-      } else if (self->u.links && self->u.links[index] != NULL) {
-         bool remove_node = stringset_remove(self->u.links[index], key + 1, removed_value);
-         if (remove_node) {
-            free(self->u.links[index]);
-            self->u.links[index] = NULL;
-            if (self->min != self->max) {
-               int newcount = 0, newsize = 0;
-               if (ch == self->min) {
-                  while (self->u.links[index] == NULL)
-                     index++;
-                  self->min += index;
-                  newcount = self->max - self->min + 1;
-                  newsize = newcount * sizeof(stringset_t*);
-               } else if (ch == self->max) {
-                  index = self->max - self->min;
-                  while (self->u.links[index] == NULL)
-                     index--;
-                  self->max = self->min + index;
-                  newcount = index + 1;
-                  newsize = newcount * sizeof(stringset_t*);
-                  index = 0;
-               }
-               if (newsize) {
-                  stringset_t** newlinks = calloc(newcount, sizeof(stringset_t*));
-                  memcpy(newlinks, self->u.links + index, newsize);
-                  free(self->u.links);
-                  self->u.links = newlinks;
-               }
-            } else {
-               free(self->u.links);
-               self->u.links = NULL;
-               self->min = 0;
-               self->max = 0;
-               self->value = NULL;
-               if (!self->value)
-                  remove_this = true;
-            }
-         }
-         if (self->u.links && self->min == self->max && (!self->value) && is_leaf(self->u.links[0])) {
-            stringset_t* child = self->u.links[0];
-            free(self->u.links);
-            self->u.leafkey = malloc(strlen(child->u.leafkey) + 2);
-            sprintf(self->u.leafkey, "%c%s", self->min, child->u.leafkey);
-            free(child->u.leafkey);
-            self->value = child->value;
-            set_leaf(self);
-            free(child);
-         }
-      }
+   stringset_node_t** parent_slot = NULL;
+   stringset_node_t** slot = &self->root;
+   while (true) {
+      stringset_node_t* node = *slot;
+      if (strncmp(key, stringset_node_label(node), node->label_len) != 0)
+         return false;
+      key += node->label_len;
+      if (key[0] == '\0')
+         break;
+      int at = node_find_child(node, key[0]);
+      if (at == -1)
+         return false;
+      parent_slot = slot;
+      slot = &(stringset_node_children(node)[at]);
+   }
+   stringset_node_t* node = *slot;
+   if (!node->value)
+      return false;
+   if (removed_value)
+      *removed_value = node->value;
+   node->value = NULL;
+   self->count--;
+   self->generation++;
+   if (!parent_slot)
+      return true;
+   if (node->nchildren == 0) {
+      stringset_node_t* parent = *parent_slot;
+      node_remove_child(parent, slot - stringset_node_children(parent));
+      free(node);
+      if (parent_slot == &self->root)
+         return true;
+      node = parent;
+      slot = parent_slot;
    }
-   return remove_this;
+   if (!node->value && node->nchildren == 1)
+      *slot = node_merge_child(node);
+   return true;
 }
 
 void* stringset_get_int(stringset_t* self, int ikey) {
@@ -269,177 +280,143 @@ void* stringset_get_int(stringset_t* self, int ikey) {
 }
 
 void* stringset_get(stringset_t* self, const char* key) {
-   assert(self);
    assert(key);
-   char ch = key[0];
-   if (is_leaf(self)) {
-      if (strcmp(self->u.leafkey, key) == 0) {
-         return self->value;
-      } else {
-         return NULL;
+   return stringset_get_n(self, key, strlen(key));
+}
+
+/*
+Like stringset_get, for a key of len bytes that need not be
+NUL-terminated.
+*/
+void* stringset_get_n(stringset_t* self, const char* key, int len) {
+   assert(self);
+   stringset_node_t* node = self->root;
+   while (true) {
+      if (node->label_len) {
+         // The first byte was already matched when choosing the child.
+         if (len < node->label_len || memcmp(key + 1, stringset_node_label(node) + 1, node->label_len - 1) != 0)
+            return NULL;
+         key += node->label_len;
+         len -= node->label_len;
       }
-   } else {
-      if (key[0] == '\0') {
-         return self->value;
-      } else if (ch < self->min || ch > self->max) {
+      if (len == 0)
+         return node->value;
+      int at = node_find_child(node, key[0]);
+      if (at == -1)
          return NULL;
-      } else if (self->u.links[ch - self->min] == NULL) {
-         return NULL;
-      } else {
-         return stringset_get(self->u.links[ch - self->min], key + 1);
-      }
+      node = stringset_node_children(node)[at];
+   }
+}
+
+static void* stringset_get_i_rec(stringset_node_t* node, const char* key) {
+   if (strncasecmp(key, stringset_node_label(node), node->label_len) != 0)
+      return NULL;
+   key += node->label_len;
+   if (key[0] == '\0')
+      return node->value;
+   void* result = NULL;
+   unsigned char first = key[0];
+   int at = node_find_child(node, tolower(first));
+   if (at != -1)
+      result = stringset_get_i_rec(stringset_node_children(node)[at], key);
+   if (!result && toupper(first) != tolower(first)) {
+      at = node_find_child(node, toupper(first));
+      if (at != -1)
+         result = stringset_get_i_rec(stringset_node_children(node)[at], key);
    }
+   return result;
 }
 
 void* stringset_get_i(stringset_t* self, const char* key) {
    assert(self);
    assert(key);
-   if (is_leaf(self)) {
-      if (strcasecmp(self->u.leafkey, key) == 0) {
-         return self->value;
-      } else {
-         return NULL;
-      }
-   } else {
-      if (key[0] == '\0') {
-         return self->value;
-      } 
-      char* result = NULL;
-      char ch = tolower(key[0]);
-      if (ch < self->min || ch > self->max) {
-         result = NULL;
-      } else if (self->u.links[ch - self->min] == NULL) {
-         result = NULL;
-      } else {
-         result = stringset_get(self->u.links[ch - self->min], key + 1);
-      }
-      if (!result) {
-         ch = toupper(key[0]);
-         if (ch < self->min || ch > self->max) {
-            result = NULL;
-         } else if (self->u.links[ch - self->min] == NULL) {
-            result = NULL;
-         } else {
-            result = stringset_get(self->u.links[ch - self->min], key + 1);
-         }
-      }
-      return result;
-   }
+   return stringset_get_i_rec(self->root, key);
 }
 
-static void stringset_scan_rec(stringset_t* self, stringset_scan_fn_t fn, void* param, char* name, int len) {
-   if (is_leaf(self)) {
-      strcpy(name + len, self->u.leafkey);
-      len += strlen(self->u.leafkey);
-      fn(param, name, self->value);
-      return;
-   }
-   if (self->value)
-      fn(param, name, self->value);
-   if (!has_links(self))
-      return;
-   for (int i = self->min; i <= self->max; i++) {
-      if (self->u.links[i - self->min]) {
-         name[len] = i;
-         name[len+1] = '\0';
-         stringset_scan_rec(self->u.links[i - self->min], fn, param, name, len+1);
-      }
-   }
+static void stringset_scan_rec(stringset_node_t* node, stringset_scan_fn_t fn, void* param, char* name, int len) {
+   memcpy(name + len, stringset_node_label(node), node->label_len);
+   len += node->label_len;
+   name[len] = '\0';
+   if (node->value)
+      fn(param, name, node->value);
+   for (int i = 0; i < node->nchildren; i++)
+      stringset_scan_rec(stringset_node_children(node)[i], fn, param, name, len);
 }
 
 void stringset_scan(stringset_t* self, stringset_scan_fn_t fn, void* param) {
    char buffer[PATH_MAX];
    buffer[0] = '\0';
-   stringset_scan_rec(self, fn, param, buffer, 0);
+   stringset_scan_rec(self->root, fn, param, buffer, 0);
 }
 
-void stringset_draw_rec(stringset_t* self, int depth) {
-   if (self->value) {
-      for (int i = 0; i < depth; i++)
-         printf("  ");
-      printf("[%p]\n", self->value);
-   }
-   if (is_leaf(self)) {
-      for (int i = 0; i < depth; i++)
-         printf("  ");
-      printf("'%s' (leaf)\n", self->u.leafkey);
-   } else {
-      if (self->u.links) {
-         for (int i = self->min; i <= self->max; i++) {
-            int idx = i - self->min;
-            if (self->u.links[idx]) {
-               for (int i = 0; i < depth; i++)
-                  printf("  ");
-               printf("'%c' (link)\n", i);
-               stringset_draw_rec(self->u.links[idx], depth+1);
-            }
-         }
-      }
-   }
+static void stringset_draw_rec(stringset_node_t* node, int depth) {
+   for (int i = 0; i < depth; i++)
+      printf("  ");
+   printf("'%.*s' (%d/%d)", node->label_len, stringset_node_label(node), node->nchildren, node->capacity);
+   if (node->value)
+      printf(" [%p]", node->value);
+   printf("\n");
+   for (int i = 0; i < node->nchildren; i++)
+      stringset_draw_rec(stringset_node_children(node)[i], depth + 1);
 }
 
 void stringset_draw(stringset_t* self) {
    printf("------------------------------------\n");
-   stringset_draw_rec(self, 0);
+   stringset_draw_rec(self->root, 0);
    printf("------------------------------------\n");
 }
 
 stringset_iter_t* stringset_iter_new(stringset_t* set) {
    stringset_iter_t* self = malloc(sizeof(stringset_iter_t));
    self->stack_size = 20;
-   self->set_stack = malloc(sizeof(stringset_t*) * self->stack_size);
-   self->at_stack = malloc(sizeof(stringset_t*) * self->stack_size);
+   self->node_stack = malloc(sizeof(stringset_node_t*) * self->stack_size);
+   self->at_stack = malloc(sizeof(int) * self->stack_size);
+   self->len_stack = malloc(sizeof(int) * self->stack_size);
    self->stack_level = 0;
    self->key[0] = '\0';
-   self->set_stack[0] = set;
-   self->at_stack[0] = set->min;
+   self->node_stack[0] = set->root;
+   self->at_stack[0] = 0;
+   self->len_stack[0] = 0;
    return self;
 }
 
 void stringset_iter_delete(stringset_iter_t* self) {
-   free(self->set_stack);
+   free(self->node_stack);
    free(self->at_stack);
+   free(self->len_stack);
    free(self);
 }
 
+/*
+Visits the values in post-order: the value of a node is returned
+after those of its children, with self->key holding its key.
+*/
 void* stringset_iter_next(stringset_iter_t* self) {
-   void* result = NULL;
-   while (!result) {
-      if (self->stack_level == -1) {
-         result = NULL;
-         break;
-      }
+   while (self->stack_level >= 0) {
       int level = self->stack_level;
-      stringset_t* set = self->set_stack[level];
+      stringset_node_t* node = self->node_stack[level];
       int at = self->at_stack[level];
-      if (is_leaf(set)) {
-         strcpy(self->key + level, set->u.leafkey);
-         self->stack_level--;
-         result = set->value;
-         break;
-      }
-      self->key[level] = at;
-      self->key[level + 1] = '\0';
-      if (has_links(set) && at <= set->max) {
-         int next_at = at + 1;
-         while (next_at <= set->max && !set->u.links[next_at - set->min])
-            next_at++;
-         self->at_stack[level] = next_at;
-         self->stack_level++;
-         if (self->stack_level == self->stack_size) {
+      int len = self->len_stack[level];
+      if (at < node->nchildren) {
+         self->at_stack[level]++;
+         stringset_node_t* child = stringset_node_children(node)[at];
+         if (level + 1 == self->stack_size) {
             self->stack_size *= 2;
-            self->set_stack = realloc(self->set_stack, sizeof(stringset_t*) * self->stack_size);
-            self->at_stack = realloc(self->at_stack, sizeof(stringset_t*) * self->stack_size);
-         }
-         self->set_stack[self->stack_level] = set->u.links[at - set->min];
-         self->at_stack[self->stack_level] = self->set_stack[self->stack_level]->min;
-      } else {
-         self->key[level] = '\0';
-         self->stack_level--;
-         if (set->value) {
-            result = set->value;
+            self->node_stack = realloc(self->node_stack, sizeof(stringset_node_t*) * self->stack_size);
+            self->at_stack = realloc(self->at_stack, sizeof(int) * self->stack_size);
+            self->len_stack = realloc(self->len_stack, sizeof(int) * self->stack_size);
          }
+         memcpy(self->key + len, stringset_node_label(child), child->label_len);
+         self->node_stack[level + 1] = child;
+         self->at_stack[level + 1] = 0;
+         self->len_stack[level + 1] = len + child->label_len;
+         self->stack_level++;
+         continue;
       }
+      self->key[len] = '\0';
+      self->stack_level--;
+      if (node->value)
+         return node->value;
    }
-   return result;
+   return NULL;
 }
@@ -41,15 +41,31 @@ Hisham Muhammad, 2005/04/07.
 
 typedef struct stringset stringset_t;
 
+typedef struct stringset_node stringset_node_t;
+
+/*
+A node of the radix tree. Each node is a single allocation holding
+the header, the child pointers, the first byte of each child's label
+(sorted, for scanning without touching the children), and the label
+of the edge leading into the node. The child array is allocated in
+power-of-two size classes and the node is reallocated to grow it.
+*/
+struct stringset_node {
+   void* value;
+   unsigned short label_len;
+   unsigned short capacity;
+   unsigned short nchildren;
+};
+
+#define stringset_node_children(n) ((stringset_node_t**) ((n) + 1))
+#define stringset_node_firsts(n) ((unsigned char*) (stringset_node_children(n) + (n)->capacity))
+#define stringset_node_label(n) ((char*) (stringset_node_firsts(n) + (n)->capacity))
+
 struct stringset {
    int count;
-   void* value;
-   union {
-      stringset_t** links;
-      char* leafkey;
-   } u;
-   char min;
-   char max;
+   // Bumped whenever a key is added or removed.
+   unsigned int generation;
+   stringset_node_t* root;
 };
 
 typedef void(*stringset_delete_fn_t)(void*);
@@ -60,8 +76,12 @@ void stringset_delete(stringset_t* self, stringset_delete_fn_t destroy_value);
 
 bool stringset_put(stringset_t* self, const char* key, void* value);
 
+bool stringset_put_n(stringset_t* self, const char* key, int len, void* value);
+
 void* stringset_get(stringset_t* self, const char* key);
 
+void* stringset_get_n(stringset_t* self, const char* key, int len);
+
 bool stringset_remove(stringset_t* self, const char* key, void** removed_value);
 
 bool stringset_put_int(stringset_t* self, int ikey, void* value);
@@ -84,8 +104,9 @@ void stringset_draw(stringset_t* self);
 
 typedef struct stringset_iter {
    char key[PATH_MAX];
-   stringset_t** set_stack;
+   stringset_node_t** node_stack;
    int* at_stack;
+   int* len_stack;
    int stack_level;
    int stack_size;
 } stringset_iter_t;
@@ -99,7 +120,8 @@ void* stringset_iter_next(stringset_iter_t* self);
       stringset_iter_t* item ## _ITERATOR = stringset_iter_new(set); \
       char* item ## _key = item ## _ITERATOR -> key; \
       type* item; \
-      while (item = stringset_iter_next( item ## _ITERATOR )) { \
+      (void) item ## _key; \
+      while ( (item = stringset_iter_next( item ## _ITERATOR )) ) { \
       do {} while (0)
 
 #define stringset_end_iterate(item) \
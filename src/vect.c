@@ -40,6 +40,11 @@ vect_t* vect_new(int blocksize) {
    return self;
 }
 
+void vect_delete(vect_t* self) {
+   free(self->array);
+   free(self);
+}
+
 int64_t vect_add(vect_t* self, void* data) {
    if (self->array) {
       if (self->buffersize - self->used < 2) {
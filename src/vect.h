@@ -40,6 +40,7 @@ struct vect {
 };
 
 vect_t* vect_new(int blocksize);
+void vect_delete(vect_t* self);
 int64_t vect_add(vect_t* v, void* data);
 void* vect_get(vect_t* v, int64_t id);
 void* vect_pop_last(vect_t* self);
@@ -28,22 +28,24 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE
 #include <ctype.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+
+#include "version.h"
 
 #define MIN(a,b) ((a)<(b)?(a):(b))
 
-int* str_to_version_number(char* str) {
+/*
+Parses the components of a version into parts, keeping no more than
+capacity of them. Returns the size of the key, counting all of them.
+*/
+static int parse_version(const char* str, int* parts, int capacity) {
    int start = 0;
    int end = 0;
-   int* values = calloc(sizeof(int), 4);
-   values[0] = 3;
+   int size = 3;
    int v = 1;
    while (str[start] != '\0') {
-      if (v == values[0]) {
-         values[0] *= 2;
-         values = realloc(values, sizeof(int) * values[0]);
-         for (int i = v; i < values[0]; i++)
-            values[i] = 0;
-      }
+      if (v == size)
+         size *= 2;
       while (isdigit(str[end]))
          end++;
       if (end != start) {
@@ -51,7 +53,8 @@ int* str_to_version_number(char* str) {
          unsigned int val = 0;
          for (c = end - 1, mag = 1; c >= start; c--, mag *= 10)
             val += (str[c] - '0') * mag;
-         values[v] = val;
+         if (v <= capacity)
+            parts[v - 1] = val;
          start = end;
          v++;
          continue;
@@ -59,7 +62,8 @@ int* str_to_version_number(char* str) {
       while (isalpha(str[end]))
          end++;
       if (end == start + 1) {
-         values[v] = 0xff - str[start];
+         if (v <= capacity)
+            parts[v - 1] = 0xff - str[start];
          start = end;
          v++;
          continue;
@@ -74,7 +78,8 @@ int* str_to_version_number(char* str) {
             val |= n;
             if (i < 5) val <<= 5;
          }
-         values[v] = val - 0x7fffffff;
+         if (v <= capacity)
+            parts[v - 1] = val - 0x7fffffff;
          start = end;
          v++;
          continue;
@@ -82,36 +87,74 @@ int* str_to_version_number(char* str) {
       end++;
       start = end;
    }
-   return values;
+   return size;
+}
+
+void str_to_version_key(const char* str, versionkey_t* key) {
+   memset(key, 0, sizeof(versionkey_t));
+   key->size = parse_version(str, key->parts, VERSION_KEY_PARTS);
+   if (key->size - 1 > VERSION_KEY_PARTS)
+      key->str = str;
 }
 
 /*
-Compares two version strings and applies some heuristics
-to decide which refers to the most recent package.
-Returns -1, 0, 1, respectively: whether v1 is more recent;
-they are considered equivalent; or v2 is more recent. 
-*/ 
-int compare_versions(char* v1, char* v2) {
-fprintf(stderr, "compare_versions(\"%s\", \"%s\")\n", v1, v2);
+Compares the parts of two versions beyond VERSION_KEY_PARTS, the
+first count of them, parsing the strings of their keys again.
+*/
+static int compare_long_versions(const versionkey_t* a, const versionkey_t* b, int count) {
    int result = 0;
-   int* a = str_to_version_number(v1);
-   int* b = str_to_version_number(v2);
-   for (int i = 1; i < MIN(a[0], b[0]); i++) {
-      if (a[i] > b[i]) {
+   int* pa = calloc(a->size - 1, sizeof(int));
+   int* pb = calloc(b->size - 1, sizeof(int));
+   parse_version(a->str, pa, a->size - 1);
+   parse_version(b->str, pb, b->size - 1);
+   for (int i = VERSION_KEY_PARTS; i < count; i++) {
+      if (pa[i] > pb[i]) {
          result = -1;
          break;
-      } else if (a[i] < b[i]) {
+      } else if (pa[i] < pb[i]) {
          result = 1;
          break;
       }
    }
-   if (result == 0) {
-      if (a[0] > b[0])
-         result = -1;
-      else if (a[0] < b[0])
-         result = 1;
-   }
-   free(a);
-   free(b);
+   free(pa);
+   free(pb);
    return result;
 }
+
+/*
+Compares two version keys, as built by str_to_version_key.
+Returns -1, 0, 1, respectively: whether a is more recent;
+they are considered equivalent; or b is more recent.
+*/
+int compare_version_keys(const versionkey_t* a, const versionkey_t* b) {
+   int count = MIN(a->size, b->size) - 1;
+   for (int i = 0; i < MIN(count, VERSION_KEY_PARTS); i++) {
+      if (a->parts[i] > b->parts[i])
+         return -1;
+      else if (a->parts[i] < b->parts[i])
+         return 1;
+   }
+   if (count > VERSION_KEY_PARTS) {
+      int result = compare_long_versions(a, b, count);
+      if (result != 0)
+         return result;
+   }
+   if (a->size > b->size)
+      return -1;
+   else if (a->size < b->size)
+      return 1;
+   return 0;
+}
+
+/*
+Compares two version strings and applies some heuristics
+to decide which refers to the most recent package.
+Returns -1, 0, 1, respectively: whether v1 is more recent;
+they are considered equivalent; or v2 is more recent. 
+*/ 
+int compare_versions(char* v1, char* v2) {
+   versionkey_t a, b;
+   str_to_version_key(v1, &a);
+   str_to_version_key(v2, &b);
+   return compare_version_keys(&a, &b);
+}
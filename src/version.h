@@ -2,6 +2,26 @@
 #ifndef VERSION_H
 #define VERSION_H
 
+/* Components of a version kept in its key */
+#define VERSION_KEY_PARTS 11
+
+/*
+A version key holds the components of a version, padded with
+zeros, and the size they were rounded up to when parsed.
+Keys are built once and compared without parsing, except for
+versions with more than VERSION_KEY_PARTS components, which keep
+the string they were built from to compare the rest of them.
+*/
+typedef struct versionkey {
+   int size;
+   int parts[VERSION_KEY_PARTS];
+   // The version string if the parts did not fit, NULL otherwise;
+   // it must outlive the key.
+   const char* str;
+} versionkey_t;
+
+void str_to_version_key(const char* str, versionkey_t* key);
+int compare_version_keys(const versionkey_t* a, const versionkey_t* b);
 int compare_versions(char* v1, char* v2);
 
 #endif
@@ -35,6 +35,10 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE
 #include <dirent.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <pthread.h>
 
 #include "cmdline.h"
 #include "vect.h"
@@ -42,105 +46,281 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE
 #include "directfuse.h"
 #include "depfile.h"
 #include "version.h"
-#include "vect.h"
-
-#define LINE_WIDTH (PATH_MAX + 3)
-#define MANIFEST_FILE "Manifest"
-#define DEPENDENCIES_FILE "Dependencies"
+#include "idmap.h"
+#include "snapshot.h"
+#include "manifest.h"
 
 static char* watch_dir;
 static vect_t* watches;
+// Package node of each watch, indexed by its watch descriptor.
+static vect_t* wd_to_package;
 static entrydata_t* packages_root_node;
 static entrydata_t* tree_root_node;
 static vect_t* id_to_v;
 static vect_t* id_to_n;
 static vect_t* free_ids;
-static stringset_t* vn_to_id;
-static list_t* depwait_list;
+static vect_t* id_to_link;
+// Set for ids registered while listing a directory that no lookup
+// has returned yet, and which the kernel therefore never forgets.
+static vect_t* id_listed;
+static uint64_t link_epoch;
+static uint64_t version_epoch;
+static idmap_t* vn_to_id;
+static depwaits_t* depwaits;
 static int forgotten;
+static bool lazy;
+static int jobs;
+static vect_t* scanned_views;
+// Entries taken out of the tree and views removed while applying
+// a batch of changes, freed by reclaim_removed once it is applied.
+static vect_t* dead_entries;
+static vect_t* removed_views;
+// What ids of freed entries and views refer to instead.
+static viewdata_t removed_data = { .removed = true };
+static entrydata_t removed_view = { .type = ET_VIEW, .u = { .view = &removed_data } };
+static entrydata_t dead_entry = { .type = ET_LINK, .flags = EF_DEAD };
 
-static void fill_with_view(entrydata_t* view) {
-   char* manifest;
-   char* package = view->u.view->package;
-   char* version = view->u.view->version;
-   asprintf(&manifest, "%s/%s/%s/%s", watch_dir, package, version, MANIFEST_FILE);
-   stringset_t* root = tree_root_node->u.dir.entries;
-   FILE* file = fopen(manifest, "r");
-   if (!file)
+/*
+A version directory that appeared or went away while mounted.
+Changes are queued until the watch directory has been quiet for
+settle_delay, so that a package is loaded only once it has been
+fully unpacked; additions also wait for the Manifest to be written.
+*/
+typedef struct pendingversion {
+   entrydata_t* package_node;
+   char* version;
+   // Watch on the version directory, if one was created.
+   int wd;
+   bool queued;
+   bool remove;
+   bool add;
+   bool manifest_ready;
+   // When to load the version even if its Manifest never shows up;
+   // pushed back while there is activity in the directory.
+   int64_t give_up;
+   // Set while the build thread loads the view into a tree of its own;
+   // the tree is kept until the batch is published. A stale build was
+   // started before the version last changed and is thrown away.
+   bool building;
+   bool stale;
+   entrydata_t* view;
+   entrydata_t* tree;
+} pendingversion_t;
+
+static stringset_t* pending_versions;
+static vect_t* event_queue;
+/*
+Version directories being installed are watched through an inotify
+instance of their own, read by version_thread, so that each watch can
+be removed once its version is loaded. version_watches maps the
+descriptors of these watches to their pending versions.
+*/
+#define VERSION_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ONLYDIR)
+static int version_fd = -1;
+static stringset_t* version_watches;
+static pthread_t version_thread;
+static int64_t settle_delay;
+static int64_t batch_deadline;
+
+/*
+Views added while mounted are loaded by a build thread, so that
+requests are not held up by reading and parsing Manifests. Jobs are
+taken in order from build_queue, starting at build_next, and handed
+back in built; built_count lets requests check for them cheaply.
+*/
+static pthread_mutex_t build_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t build_wanted = PTHREAD_COND_INITIALIZER;
+static pthread_t build_thread;
+static bool build_started;
+static vect_t* build_queue;
+static int64_t build_next;
+static vect_t* built;
+static int built_count;
+
+/*
+Resolved target of a link as seen from a view, and the link_epoch it
+was resolved at. link_epoch is bumped whenever a priority list or the
+views of some links may change; the cached target stays valid unless
+it predates the last change to either the view's priority list or
+the views of its own link.
+*/
+typedef struct linkcache {
+   uint64_t epoch;
+   int len;
+   char target[];
+} linkcache_t;
+
+/*
+An entry of a listing, with the offset that resumes a listing after
+it: a hash of its name, so that it stays valid while other entries
+come and go.
+*/
+typedef struct listingentry {
+   int64_t cookie;
+   char* name;
+   entrydata_t* entry;
+} listingentry_t;
+
+/*
+Copy of the entries of a directory in cookie order, so that a listing
+can be resumed at an offset. Large directories keep theirs, so that
+listing them again does not walk their radix tree; it is valid while
+the generation of the entries is unchanged. Directories key the cache,
+which is cleared whenever reclaim_removed frees some; each slot has a
+lock of its own.
+*/
+typedef struct listing {
+   entrydata_t* dir;
+   unsigned int generation;
+   int count;
+   listingentry_t* entries;
+   char* strings;
+} listing_t;
+
+#define LISTINGS 64
+#define LISTING_MIN 256
+static listing_t listings[LISTINGS];
+static pthread_mutex_t listing_locks[LISTINGS];
+
+/*
+Requests may be served from several threads at once. Lookup, getattr,
+getdir and readlink hold tree_lock shared while they read the tree.
+Inotify events, applying queued changes, loading pending Manifests
+and resolving the dependencies of a view change the tree, and hold
+tree_lock exclusively; a request that finds it has to do one of the
+latter drops its shared lock and starts over holding it exclusively.
+The id tables are guarded by id_lock, held exclusively only to
+register or forget ids. The link cache entry of an id is guarded
+by one of link_locks, and the ranks of a view by one of rank_locks.
+Locks are taken in that order; a slot of the listing cache is locked
+before id_lock.
+*/
+static pthread_rwlock_t tree_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_rwlock_t id_lock = PTHREAD_RWLOCK_INITIALIZER;
+#define LINK_LOCKS 64
+static pthread_mutex_t link_locks[LINK_LOCKS];
+#define RANK_LOCKS 64
+static pthread_mutex_t rank_locks[RANK_LOCKS];
+// When the queued changes need to be looked at next; read without
+// holding tree_lock, so that requests skip it while nothing is due.
+static int64_t next_flush = INT64_MAX;
+// Number of directories flagged EF_HINT.
+static int pending_hints = 0;
+
+/*
+Inserts the entries of the view's Manifest into the tree at root_node.
+*/
+static void fill_with_view(entrydata_t* view, entrydata_t* root_node) {
+   char* dirname;
+   view->u.view->loaded = true;
+   asprintf(&dirname, "%s/%s/%s", watch_dir, view->u.view->package, view->u.view->version);
+   manifest_load(dirname, view, root_node);
+   free(dirname);
+}
+
+/*
+Registers a view whose Manifest is to be loaded on demand.
+The top-level directories of the package are used as a hint of
+where its entries may live: the view is left pending on each of
+them, so that it is only loaded when one of them is visited.
+Packages with other top-level entries, or none at all, are left
+pending on the root. Directories created just as hints are flagged,
+so that they are pruned if no Manifest turns out to list them.
+*/
+static void defer_view(entrydata_t* view) {
+   char* dirname;
+   asprintf(&dirname, "%s/%s/%s", watch_dir, view->u.view->package, view->u.view->version);
+   DIR* d = opendir(dirname);
+   free(dirname);
+   if (!d) {
+      entrydata_add_pending_view(tree_root_node, view);
       return;
-   stringset_t* tree;
-   char line[LINE_WIDTH + 1];
-   line[LINE_WIDTH] = '\0';
-   while (!feof(file)) {
-      if (!fgets(line, LINE_WIDTH - 1, file))
-         break;
-      if (line[0] == '#' || line[0] == '\n' || strlen(line) < 3)
+   }
+   bool at_root = false;
+   bool hinted = false;
+   struct dirent* ent;
+   while ( (ent = readdir(d)) ) {
+      if (ent->d_name[0] == '.' || strcmp(ent->d_name, MANIFEST_FILE) == 0 || strcmp(ent->d_name, COMPILED_MANIFEST_FILE) == 0 || strcmp(ent->d_name, DEPENDENCIES_FILE) == 0)
          continue;
-      char* newline = strrchr(line, '\n');
-      if (newline)
-         *(newline) = '\0';
-      char type = line[0];
-      char* path = &(line[2]);
-
-      tree = root;
-      char* word = path;
-      entrydata_t* added = NULL;
-      char* slash;
-      while (slash = strchr(word, '/')) {
-         *(slash) = '\0';
-         entrydata_t* entry = (entrydata_t*) stringset_get(tree, word);
-         if (entry) {
-            if (entry->type == ET_DIR) {
-               tree = entry->u.dir.entries;
-               if (!tree) {
-                  tree = stringset_new(NULL);
-                  entry->u.dir.entries = tree;
-               }
-            } else {
-               tree = NULL;
-               break;
-            }
-         } else {
-            stringset_t* newtree = stringset_new(NULL);
-            added = entrydata_new(ET_DIR, newtree);
-            if (stringset_put(tree, word, added)) {
-               tree = newtree;
-            } else {
-               tree = NULL;
-               break;
-            }
+      entrydata_t* entry = NULL;
+      if (ent->d_type == DT_DIR) {
+         entry = stringset_get(tree_root_node->u.dir.entries, ent->d_name);
+         if (!entry) {
+            entry = entrydata_new(ET_DIR, NULL, tree_root_node, ent->d_name);
+            entry->flags |= EF_HINT;
+            pending_hints++;
+            entrydata_add_subentry(tree_root_node, ent->d_name, entry);
          }
-         *(slash) = '/';
-         word = slash + 1;
       }
-      if (!tree)
-         continue;
-      switch (type) {
-      case 'd':
-         stringset_put(tree, word, entrydata_new(ET_DIR, NULL));
-         break;
-      default:
-         {
-            entrydata_t* entry;
-            if (entry = stringset_get(tree, word)) {
-               if (entry->type == ET_LINK)
-                  entrydata_add_view_to_link(entry, view);
-               else
-                  fprintf(stderr, "viewfs: warning: %s/%s attempted to add %s as link (already directory)\n", package, version, path);
-            } else {
-               stringset_put(tree, word, entrydata_new(ET_LINK, view, path));
-            }
-            break;
-         }
+      if (entry && entry->type == ET_DIR) {
+         entrydata_add_pending_view(entry, view);
+         hinted = true;
+      } else if (!at_root) {
+         entrydata_add_pending_view(tree_root_node, view);
+         at_root = true;
       }
    }
-   fclose(file);
-   free(manifest);
+   closedir(d);
+   if (!hinted && !at_root)
+      entrydata_add_pending_view(tree_root_node, view);
+}
+
+/*
+Marks the links a view was just added to as changed, so that only
+their cached targets are resolved again.
+*/
+static void links_changed(entrydata_t* view) {
+   vect_t* touched = view->u.view->touched;
+   link_epoch++;
+   for (int64_t i = 0; touched && i < touched->used; i++) {
+      entrydata_t* entry = touched->array[i];
+      if (entry->type == ET_LINK)
+         entry->u.link.epoch = link_epoch;
+   }
+}
+
+static void priorities_changed(viewdata_t* root) {
+   root->priority_epoch = ++link_epoch;
 }
 
-static bool match_constraints(char* version, list_t* constraints) {
+static void clear_hint(entrydata_t* dir);
+
+/*
+Loads the Manifests of all views pending on a directory.
+*/
+static void materialize(entrydata_t* dir) {
+   list_t* pending = dir->u.dir.pending;
+   if (!pending)
+      return;
+   dir->u.dir.pending = NULL;
+   list_foreach(entrydata_t, view, pending) {
+      if (!view->u.view->loaded && !view->u.view->removed) {
+         fill_with_view(view, tree_root_node);
+         links_changed(view);
+      }
+   }
+   list_delete(pending, NULL);
+   clear_hint(dir);
+}
+
+/*
+Loads the views pending on the hint directories at the root, so that
+the ones no Manifest lists are pruned before the root is listed.
+*/
+static void materialize_hints() {
+   vect_t* hints = vect_new(8);
+   stringset_begin_iterate(entrydata_t, dir, tree_root_node->u.dir.entries);
+      if (dir->flags & EF_HINT)
+         vect_add(hints, dir);
+   stringset_end_iterate(dir);
+   for (int64_t i = 0; i < hints->used; i++)
+      materialize(hints->array[i]);
+   vect_delete(hints);
+}
+
+static bool match_constraints(entrydata_t* view, list_t* constraints) {
    list_foreach(constraint_t, constraint, constraints) {
-      int cmp = compare_versions(version, constraint->version);
+      int cmp = compare_version_keys(&view->u.view->version_key, &constraint->version_key);
       switch (constraint->kind) {
       case REL_EQ: if (cmp != 0) return false; break;
       case REL_NE: if (cmp == 0) return false; break;
@@ -153,42 +333,127 @@ static bool match_constraints(char* version, list_t* constraints) {
    return true;
 }
 
+/*
+Returns the position of the first version in a newest-first index
+that is older than key, or no newer than key if inclusive.
+*/
+static int64_t version_bound(vect_t* versions, const versionkey_t* key, bool inclusive) {
+   int64_t lo = 0, hi = versions->used;
+   while (lo < hi) {
+      int64_t mid = lo + (hi - lo) / 2;
+      entrydata_t* version = versions->array[mid];
+      int cmp = compare_version_keys(&version->u.view->version_key, key);
+      if (cmp == 1 || (inclusive && cmp == 0))
+         hi = mid;
+      else
+         lo = mid + 1;
+   }
+   return lo;
+}
+
+/*
+Finds the newest version of a package that satisfies all constraints
+of a dependency. The ordered constraints narrow the version index
+to a range; the versions in it are then checked against the rest.
+*/
 static entrydata_t* find_version(dep_t* dep) {
-   entrydata_t* chosen = NULL;
    entrydata_t* package = stringset_get_i(packages_root_node->u.dir.entries, dep->name);
-   entrydata_t* version;
-   stringset_iter_t* iter = stringset_iter_new(package->u.dir.entries);
-   while (version = (entrydata_t*) stringset_iter_next(iter)) {
-      if (match_constraints(iter->key, dep->constraints)) {
-         chosen = version;
+   if (!package || !package->u.dir.versions)
+      return NULL;
+   vect_t* versions = package->u.dir.versions;
+   int64_t lo = 0, hi = versions->used;
+   list_foreach(constraint_t, constraint, dep->constraints) {
+      int64_t at;
+      switch (constraint->kind) {
+      case REL_LT: case REL_LE: case REL_EQ:
+         at = version_bound(versions, &constraint->version_key, constraint->kind != REL_LT);
+         if (at > lo) lo = at;
+         break;
+      default:
+         break;
+      }
+      switch (constraint->kind) {
+      case REL_GT: case REL_GE: case REL_EQ:
+         at = version_bound(versions, &constraint->version_key, constraint->kind == REL_GT);
+         if (at < hi) hi = at;
+         break;
+      default:
          break;
       }
    }
-   stringset_iter_delete(iter);
-   return chosen;
+   for (int64_t i = lo; i < hi; i++) {
+      if (match_constraints(versions->array[i], dep->constraints))
+         return versions->array[i];
+   }
+   return NULL;
+}
+
+/*
+Loads the dependency rules of a view, unless its Dependencies file
+was already found missing. Returns false if the view has none.
+*/
+static bool load_dep_rules(viewdata_t* view) {
+   if (view->dep_rules)
+      return true;
+   if (view->no_dependencies)
+      return false;
+   char* depfile;
+   asprintf(&depfile, "%s/%s/%s/%s", watch_dir, view->package, view->version, DEPENDENCIES_FILE);
+   if (access(depfile, F_OK) == 0)
+      view->dep_rules = depfile_parse(depfile);
+   free(depfile);
+   view->no_dependencies = (view->dep_rules == NULL);
+   return !view->no_dependencies;
+}
+
+/*
+Loads the dependency rules of a view, and resolves each of them
+to a version. The result is kept until versions are added, so that
+views shared by many dependency trees are only resolved once.
+Returns false if the view has no Dependencies file.
+*/
+static bool resolve_dependencies(viewdata_t* view) {
+   if (!load_dep_rules(view))
+      return false;
+   if (view->resolved && view->resolved_epoch == version_epoch)
+      return true;
+   if (!view->resolved)
+      view->resolved = vect_new(8);
+   view->resolved->used = 0;
+   list_foreach(dep_t, dep_rule, view->dep_rules)
+      vect_add(view->resolved, find_version(dep_rule));
+   view->resolved_epoch = version_epoch;
+   return true;
+}
+
+static void add_dependent(entrydata_t* view, entrydata_t* root_view) {
+   if (!view->u.view->dependents)
+      view->u.view->dependents = list_new();
+   list_put(view->u.view->dependents, 0, root_view);
 }
 
 void scan_dependencies(entrydata_t* scanning, entrydata_t* root_view) {
 /*
 // Some useful stats for debugging
-fprintf(stderr, "scan_dependencies(%s/%s, %s/%s) - forgotten: %d - ids: %d - free_ids: %d\n",
+fprintf(stderr, "scan_dependencies(%s/%s, %s/%s) - forgotten: %d - ids: %d - free_ids: %d - depwaits: %d (%d on %s)\n",
 scanning->u.view->package, scanning->u.view->version, root_view->u.view->package, root_view->u.view->version,
-forgotten, id_to_v->used, free_ids->used);
-*/
-   if (!scanning->u.view->dep_rules) {
-      char* depfile;
-      asprintf(&depfile, "%s/%s/%s/%s", watch_dir, scanning->u.view->package, scanning->u.view->version, DEPENDENCIES_FILE);
-      scanning->u.view->dep_rules = depfile_parse(depfile);
-      free(depfile);
-      if (!scanning->u.view->dep_rules)
-         return; // No suitable dependencies file.
-   }
-   if (!root_view->u.view->priority_views)
-      root_view->u.view->priority_views = list_new();
-   list_t* chosen_deps = list_new();
-   list_t* sub_deps = NULL;
+forgotten, id_to_v->used, free_ids->used, depwaits->count, depwaits_pending(depwaits, scanning->u.view->package), scanning->u.view->package);
+*/
+   viewdata_t* root = root_view->u.view;
+   if (!resolve_dependencies(scanning->u.view))
+      return; // No suitable dependencies file.
+   if (scanning == root_view && root->dep_names)
+      return; // Already resolved; later versions arrive through depwaits.
+   if (!root->priority_views)
+      root->priority_views = list_new();
+   if (!root->dep_names)
+      root->dep_names = stringset_new(NULL);
+   vect_t* chosen_deps = vect_new(8);
+   vect_t* visited = vect_new(8);
+   int i = 0;
    list_foreach(dep_t, dep_rule, scanning->u.view->dep_rules) {
-      if (scanning != root_view && (list_find(root_view->u.view->dep_rules, dep_rule->name, dep_find) || strcasecmp(root_view->u.view->package, dep_rule->name) == 0)) {
+      entrydata_t* chosen = scanning->u.view->resolved->array[i++];
+      if (scanning != root_view && (stringset_get(root->dep_names, dep_rule->name) || strcasecmp(root->package, dep_rule->name) == 0)) {
          // Avoid redundancy/circular loops:
          // if dependency was already processed in the context of the root_view,
          // don't process it.
@@ -196,48 +461,257 @@ forgotten, id_to_v->used, free_ids->used);
          // i.e., currently, dependencies that appear lower on the tree
          // cannot enforce further constraints on which versions are accepted.
          continue;
-      } else {
-         if (!sub_deps)
-            sub_deps = list_new();
-         list_put(sub_deps, 0, dep_new(dep_rule->name));
       }
-      entrydata_t* chosen = find_version(dep_rule);
+      vect_add(visited, dep_rule->name);
       if (chosen) {
-         list_put(chosen_deps, 0, chosen);
+         vect_add(chosen_deps, chosen);
       } else {
-         list_put(depwait_list, 0, depwait_new(dep_rule, root_view));
+         depwaits_add(depwaits, depwait_new(dep_rule, root_view));
       }
    }
-   if (sub_deps) {
-      list_merge_contents_into(root_view->u.view->dep_rules, sub_deps);
-      free(sub_deps);
-   }
-   list_merge_contents_into(root_view->u.view->priority_views, chosen_deps);
-   list_foreach(entrydata_t, chosen_dep, chosen_deps) {
-      scan_dependencies(chosen_dep, root_view);
+   for (i = 0; i < visited->used; i++)
+      stringset_put(root->dep_names, visited->array[i], root);
+   if (chosen_deps->used)
+      priorities_changed(root);
+   for (i = 0; i < chosen_deps->used; i++) {
+      entrydata_t* chosen = chosen_deps->array[i];
+      list_put(root->priority_views, 0, chosen);
+      add_dependent(chosen, root_view);
    }
-   free(chosen_deps);
+   for (i = 0; i < chosen_deps->used; i++)
+      scan_dependencies(chosen_deps->array[i], root_view);
+   vect_delete(chosen_deps);
+   vect_delete(visited);
 }
 
-static void add_view(entrydata_t* package_node, char* package, char* version) {
+static void satisfy_depwaits(entrydata_t* view);
+
+static void add_view(entrydata_t* package_node, char* package, char* version, bool defer) {
    entrydata_t* view = entrydata_new(ET_VIEW, package, version);
-   entrydata_add_subentry(package_node, version, view);
-   fill_with_view(view);
+   entrydata_add_version(package_node, version, view);
+   version_epoch++;
+   if (!defer) {
+      fill_with_view(view, tree_root_node);
+      links_changed(view);
+   } else if (lazy)
+      defer_view(view);
+   else
+      vect_add(scanned_views, view);
+   satisfy_depwaits(view);
+}
 
-   depwait_t* depwait;
-   list_iter_t* iter = list_iter_new(depwait_list);
-   while (depwait = list_iterate_take(iter, package, depwait_find)) {
-      if (match_constraints(version, depwait->dep->constraints)) {
+/*
+Gives a newly added view to the roots waiting for its package.
+*/
+static void satisfy_depwaits(entrydata_t* view) {
+   list_t* waits = depwaits_take(depwaits, view->u.view->package);
+   if (!waits)
+      return;
+   list_foreach(depwait_t, depwait, waits) {
+      if (match_constraints(view, depwait->dep->constraints)) {
          list_put(depwait->view->u.view->priority_views, 0, view);
+         add_dependent(view, depwait->view);
+         priorities_changed(depwait->view->u.view);
          scan_dependencies(view, depwait->view);
+         depwait_delete(depwait);
+      } else {
+         depwaits_add(depwaits, depwait);
+      }
+   }
+   list_delete(waits, NULL);
+}
+
+/*
+Takes an entry out of the tree, to be freed once the batch is applied.
+*/
+static void unlink_entry(entrydata_t* entry) {
+   if (entry->flags & EF_DEAD)
+      return;
+   entrydata_unlink(entry);
+   vect_add(dead_entries, entry);
+}
+
+/*
+Called once the views pending on a directory are loaded or gone;
+a hint directory that no Manifest listed is pruned.
+*/
+static void clear_hint(entrydata_t* dir) {
+   if (!(dir->flags & EF_HINT))
+      return;
+   dir->flags &= ~EF_HINT;
+   pending_hints--;
+   if (dir->u.dir.refs == 0 && (!dir->u.dir.entries || dir->u.dir.entries->count == 0))
+      unlink_entry(dir);
+}
+
+/*
+Replaces a link that other views still share with a copy, so that the
+arena of the removed view it was allocated from can be freed. The old
+node points to the copy until reclaim_removed updates what refers to it.
+*/
+static void move_link(entrydata_t* link) {
+   entrydata_t* copy = entrydata_copy_link(link);
+   stringset_t* entries = link->parent->u.dir.entries;
+   stringset_remove(entries, link->name, NULL);
+   stringset_put(entries, copy->name, copy);
+   link->flags |= EF_MOVED;
+   link->parent = copy;
+   vect_add(dead_entries, link);
+}
+
+/*
+Takes the entries a removed view added out of the tree, following
+the reverse index built as its Manifest was loaded. Links left with
+no views are unlinked, as are directories no remaining view lists
+and that are left empty; links kept by other views are moved out of
+the view's arena.
+*/
+static void remove_view_entries(entrydata_t* view) {
+   vect_t* touched = view->u.view->touched;
+   arena_t* arena = view->u.view->arena;
+   if (!touched)
+      return;
+   for (int64_t i = 0; i < touched->used; i++) {
+      entrydata_t* entry = touched->array[i];
+      // Moved while removing another view in the same batch.
+      if (entry->flags & EF_MOVED)
+         entry = entry->parent;
+      if (entry->type == ET_LINK) {
+         entry->u.link.epoch = link_epoch;
+         if (entrydata_remove_view_from_link(entry, view))
+            unlink_entry(entry);
+         else if ((entry->flags & EF_ARENA) && arena && arena_contains(arena, entry))
+            move_link(entry);
       } else {
-         list_prepend(depwait_list, 0, depwait);
+         entry->u.dir.refs--;
+      }
+   }
+   for (int64_t i = 0; i < touched->used; i++) {
+      entrydata_t* dir = touched->array[i];
+      while (dir->type == ET_DIR && dir != tree_root_node && !(dir->flags & EF_DEAD)
+             && dir->u.dir.refs == 0 && !dir->u.dir.pending
+             && (!dir->u.dir.entries || dir->u.dir.entries->count == 0)) {
+         unlink_entry(dir);
+         dir = dir->parent;
+      }
+   }
+   vect_delete(touched);
+   view->u.view->touched = NULL;
+}
+
+/*
+Takes a view that was never loaded out of the directories it was
+left pending on, pruning the ones defer_view created just for it.
+*/
+static void remove_pending_view(entrydata_t* view) {
+   vect_t* emptied = vect_new(8);
+   stringset_begin_iterate(entrydata_t, dir, tree_root_node->u.dir.entries);
+      if (dir->type != ET_DIR || !dir->u.dir.pending)
+         continue;
+      while (list_find_take(dir->u.dir.pending, view, list_find_pointer_eq))
+         ;
+      if (dir->u.dir.pending->hd)
+         continue;
+      list_delete(dir->u.dir.pending, NULL);
+      dir->u.dir.pending = NULL;
+      if ((dir->flags & EF_HINT) || (dir->u.dir.refs == 0 && (!dir->u.dir.entries || dir->u.dir.entries->count == 0)))
+         vect_add(emptied, dir);
+   stringset_end_iterate(dir);
+   for (int64_t i = 0; i < emptied->used; i++) {
+      entrydata_t* dir = emptied->array[i];
+      if (dir->flags & EF_HINT)
+         clear_hint(dir);
+      else
+         unlink_entry(dir);
+   }
+   vect_delete(emptied);
+   if (tree_root_node->u.dir.pending) {
+      while (list_find_take(tree_root_node->u.dir.pending, view, list_find_pointer_eq))
+         ;
+   }
+}
+
+static bool depwait_is_reset(void* item, void* sample) {
+   (void) sample;
+   return ((depwait_t*) item)->view->u.view->dep_names == NULL;
+}
+
+/*
+Clears the dependencies resolved for a root view, so that
+scan_dependencies resolves them again from scratch.
+*/
+static void reset_dependencies(entrydata_t* root_view) {
+   viewdata_t* root = root_view->u.view;
+   if (root->priority_views) {
+      // Each time a view was added to the list, the root was added
+      // to its dependents.
+      list_foreach(entrydata_t, view, root->priority_views) {
+         if (view->u.view->dependents)
+            list_find_take(view->u.view->dependents, root_view, list_find_pointer_eq);
       }
+      list_delete(root->priority_views, NULL);
    }
-   list_iter_delete(iter);
+   if (root->dep_names)
+      stringset_delete(root->dep_names, NULL);
+   root->priority_views = NULL;
+   root->dep_names = NULL;
+   priorities_changed(root);
 }
 
-static void create_watch(char* location) {
+/*
+Removes a version of a package. Root views that chose it as a
+dependency are resolved again, and their depwaits requeued.
+The view and the entries it leaves dead are freed by reclaim_removed
+once the batch is applied.
+*/
+static void remove_view(entrydata_t* package_node, const char* version) {
+   entrydata_t* view = NULL;
+   if (package_node->u.dir.entries)
+      stringset_remove(package_node->u.dir.entries, version, (void**) &view);
+   if (!view)
+      return;
+   entrydata_count_subdir(package_node, view, -1);
+   viewdata_t* data = view->u.view;
+   data->removed = true;
+   vect_t* versions = package_node->u.dir.versions;
+   for (int64_t i = 0; i < versions->used; i++) {
+      if (versions->array[i] == view) {
+         memmove(&versions->array[i], &versions->array[i+1], (versions->used - i - 1) * sizeof(void*));
+         versions->used--;
+         break;
+      }
+   }
+   link_epoch++;
+   version_epoch++;
+   if (data->loaded)
+      remove_view_entries(view);
+   // A view loaded for one directory is still pending on the others.
+   if (!data->loaded || lazy)
+      remove_pending_view(view);
+
+   vect_t* roots = vect_new(8);
+   list_t* dependents = data->dependents;
+   data->dependents = NULL;
+   if (dependents) {
+      list_foreach(entrydata_t, root, dependents) {
+         if (!root->u.view->removed && root->u.view->dep_names)
+            vect_add(roots, root);
+         reset_dependencies(root);
+      }
+      list_delete(dependents, NULL);
+   }
+   reset_dependencies(view);
+   vect_add(removed_views, view);
+   depwaits_remove(depwaits, depwait_is_reset, NULL);
+   for (int64_t i = 0; i < roots->used; i++)
+      scan_dependencies(roots->array[i], roots->array[i]);
+   vect_delete(roots);
+}
+
+/*
+Watches a package directory.
+*/
+static void create_watch(char* location, entrydata_t* package_node) {
    inodewatch_t* watch = inodewatch_new(location);
    if (!directfuse_add_watch(watch)) {
       char* pwd = getcwd(NULL, 0);
@@ -245,28 +719,168 @@ static void create_watch(char* location) {
       free(pwd);
    }
    vect_add(watches, watch);
+   if (watch->wd <= 0)
+      return;
+   while (wd_to_package->used <= watch->wd)
+      vect_add(wd_to_package, NULL);
+   // A descriptor is only reused after its watch is gone,
+   // so a new directory simply takes over the slot.
+   vect_set(wd_to_package, watch->wd, package_node);
 }
 
-static void add_package(char* package) {
+static entrydata_t* add_package_node(char* package) {
    char* dirname;
    asprintf(&dirname, "%s/%s", watch_dir, package);
-   create_watch(dirname);
-
-   entrydata_t* package_node = entrydata_new(ET_DIR, NULL);
+   entrydata_t* package_node = entrydata_new(ET_DIR, NULL, packages_root_node, package);
    entrydata_add_subentry(packages_root_node, package, package_node);
+   create_watch(dirname, package_node);
+   free(dirname);
+   return package_node;
+}
 
+static void add_package(char* package, bool defer) {
+   entrydata_t* package_node = add_package_node(package);
+   char* dirname;
+   asprintf(&dirname, "%s/%s", watch_dir, package);
    DIR* d = opendir(dirname);
    if (!d) return; /* ignore non-directories */
    struct dirent* version;
    while ( (version = readdir(d)) ) {
       if (version->d_name[0] == '.')
          continue;
-      add_view(package_node, package, version->d_name);
+      add_view(package_node, package, version->d_name, defer);
    }
    closedir(d);
    free(dirname);
 }
 
+/*
+Creates the watches for the packages of a loaded snapshot.
+*/
+static void watch_packages() {
+   stringset_begin_iterate(entrydata_t, package, packages_root_node->u.dir.entries);
+      char* dirname;
+      asprintf(&dirname, "%s/%s", watch_dir, package_key);
+      create_watch(dirname, package);
+      free(dirname);
+   stringset_end_iterate(package);
+}
+
+/*
+Records a subtree moved over by merge_tree as touched by the view.
+Its directories were already counted when the view's tree was built.
+*/
+static void record_tree(entrydata_t* entry, entrydata_t* view) {
+   entrydata_record(view, entry);
+   if (entry->type != ET_DIR || !entry->u.dir.entries)
+      return;
+   stringset_begin_iterate(entrydata_t, sub, entry->u.dir.entries);
+      record_tree(sub, view);
+   stringset_end_iterate(sub);
+}
+
+/*
+Merges a tree built from a single view into the main tree.
+Nodes missing from dst are moved over; what is left of src is freed.
+Since a Manifest describes a real directory, no path in it is both
+a link and a directory, so this gives the same result as inserting
+the view's Manifest directly into dst.
+*/
+static void merge_tree(entrydata_t* dst, entrydata_t* src, entrydata_t* view) {
+   if (!src->u.dir.entries)
+      return;
+   stringset_begin_iterate(entrydata_t, entry, src->u.dir.entries);
+      entrydata_t* existing = NULL;
+      if (dst->u.dir.entries)
+         existing = stringset_get(dst->u.dir.entries, entry_key);
+      if (!existing) {
+         entrydata_add_subentry(dst, entry_key, entry);
+         record_tree(entry, view);
+         continue;
+      }
+      if (existing->type == ET_DIR && entry->type == ET_DIR) {
+         entrydata_touch_dir(existing, view);
+         merge_tree(existing, entry, view);
+      } else if (existing->type == ET_LINK && entry->type == ET_LINK) {
+         entrydata_add_view_to_link(existing, view);
+         entrydata_record(view, existing);
+      } else if (entry->type == ET_LINK) {
+         char path[PATH_MAX];
+         entrydata_path(entry, path, PATH_MAX);
+         fprintf(stderr, "viewfs: warning: %s/%s attempted to add %s as link (already directory)\n", view->u.view->package, view->u.view->version, path);
+      }
+      entrydata_delete(entry);
+   stringset_end_iterate(entry);
+   stringset_delete(src->u.dir.entries, NULL);
+   src->u.dir.entries = NULL;
+}
+
+typedef struct scan_pool {
+   pthread_mutex_t lock;
+   pthread_cond_t done;
+   int next;
+   entrydata_t** trees;
+} scan_pool_t;
+
+static void* scan_worker(void* cast) {
+   scan_pool_t* pool = (scan_pool_t*) cast;
+   while (true) {
+      pthread_mutex_lock(&pool->lock);
+      int i = pool->next++;
+      pthread_mutex_unlock(&pool->lock);
+      if (i >= scanned_views->used)
+         break;
+      entrydata_t* tree = entrydata_new(ET_DIR, stringset_new(NULL), NULL, NULL);
+      fill_with_view(scanned_views->array[i], tree);
+      pthread_mutex_lock(&pool->lock);
+      pool->trees[i] = tree;
+      pthread_cond_broadcast(&pool->done);
+      pthread_mutex_unlock(&pool->lock);
+   }
+   return NULL;
+}
+
+/*
+Loads the Manifests of the views found by the initial scan using
+a pool of worker threads, each building a separate tree per view.
+The trees are merged into the main tree in scan order, as they are
+completed, so the result is the same as with a sequential scan.
+*/
+static void fill_scanned_views() {
+   int count = scanned_views->used;
+   if (count == 0)
+      return;
+   scan_pool_t pool;
+   pthread_mutex_init(&pool.lock, NULL);
+   pthread_cond_init(&pool.done, NULL);
+   pool.next = 0;
+   pool.trees = calloc(count, sizeof(entrydata_t*));
+   pthread_t* threads = calloc(jobs, sizeof(pthread_t));
+   for (int t = 0; t < jobs; t++)
+      pthread_create(&threads[t], NULL, scan_worker, &pool);
+   for (int i = 0; i < count; i++) {
+      pthread_mutex_lock(&pool.lock);
+      while (!pool.trees[i])
+         pthread_cond_wait(&pool.done, &pool.lock);
+      entrydata_t* tree = pool.trees[i];
+      pthread_mutex_unlock(&pool.lock);
+      // What the view touched in its own tree is recorded again
+      // as it is merged.
+      entrydata_t* view = scanned_views->array[i];
+      if (view->u.view->touched)
+         view->u.view->touched->used = 0;
+      merge_tree(tree_root_node, tree, view);
+      entrydata_delete(tree);
+   }
+   for (int t = 0; t < jobs; t++)
+      pthread_join(threads[t], NULL);
+   free(threads);
+   free(pool.trees);
+   pthread_cond_destroy(&pool.done);
+   pthread_mutex_destroy(&pool.lock);
+   scanned_views->used = 0;
+}
+
 static void scan_watch_dir() {
    DIR* d = opendir(watch_dir);
    if (!d) {
@@ -277,9 +891,10 @@ static void scan_watch_dir() {
    while ( (ent = readdir(d)) ) {
       if (ent->d_name[0] == '.')
          continue;
-      add_package(ent->d_name);
+      add_package(ent->d_name, lazy || jobs > 1);
    }
    closedir(d);
+   fill_scanned_views();
 }
 
 void show(uint64_t i64) {
@@ -289,7 +904,7 @@ void show(uint64_t i64) {
    fprintf(stderr, "\n");
 }
 
-void id_to_view_node(uint64_t id, entrydata_t** view, entrydata_t** node) {
+static void lookup_id(uint64_t id, entrydata_t** view, entrydata_t** node) {
    *view = vect_get(id_to_v, id);
    *node = vect_get(id_to_n, id);
    if (*node && (*node)->type == ET_VIEW) {
@@ -298,23 +913,32 @@ void id_to_view_node(uint64_t id, entrydata_t** view, entrydata_t** node) {
    }
 }
 
-uint64_t view_node_to_id(entrydata_t* view, entrydata_t* node) {
-   stringset_t* nodeset = stringset_get_int(vn_to_id, (int) view);
-   if (!nodeset) {
-      return 0;
-   } else {
-      uint64_t id = (uint64_t)(uint32_t) stringset_get_int(nodeset, (int) node);
-      return id;
-   }
+void id_to_view_node(uint64_t id, entrydata_t** view, entrydata_t** node) {
+   pthread_rwlock_rdlock(&id_lock);
+   lookup_id(id, view, node);
+   pthread_rwlock_unlock(&id_lock);
 }
 
-uint64_t register_view_node(entrydata_t* view, entrydata_t* node) {
+/*
+Whether an id refers to an entry or a view that has been removed.
+*/
+static bool is_dead(entrydata_t* view, entrydata_t* node) {
+   return (node->flags & EF_DEAD) || (view && view->u.view->removed);
+}
+
+/*
+Takes a free id for the pair, or a new one.
+Called holding id_lock exclusively.
+*/
+static uint64_t alloc_id(entrydata_t* view, entrydata_t* node) {
    uint64_t id;
    if (free_ids->used > 0) {
-      id = (uint64_t)(uint32_t) vect_pop_last(free_ids);
+      id = (uint64_t)(uintptr_t) vect_pop_last(free_ids);
       vect_set(id_to_v, id, view);
       vect_set(id_to_n, id, node);
    } else {
+      vect_add(id_to_link, NULL);
+      vect_add(id_listed, NULL);
       vect_add(id_to_v, view);
       id = vect_add(id_to_n, node);
       if (id > 4294967295) {
@@ -322,13 +946,37 @@ uint64_t register_view_node(entrydata_t* view, entrydata_t* node) {
       }
    }
 
-   stringset_t* nodeset = stringset_get_int(vn_to_id, (int) view);
-   if (!nodeset) {
-      nodeset = stringset_new(NULL);
-      stringset_put_int(vn_to_id, (int) view, nodeset);
-   }
+   idmap_put(vn_to_id, view, node, id);
+   return id;
+}
 
-   stringset_put_int(nodeset, (int) node, (void*) (uint32_t) id);
+/*
+Returns the id of a pair for a lookup, if it has one, and marks it
+as known to the kernel.
+*/
+static uint64_t claim_id(entrydata_t* view, entrydata_t* node) {
+   pthread_rwlock_rdlock(&id_lock);
+   uint64_t id = idmap_get(vn_to_id, view, node);
+   if (id && __atomic_load_n(&id_listed->array[id], __ATOMIC_RELAXED))
+      __atomic_store_n(&id_listed->array[id], NULL, __ATOMIC_RELAXED);
+   pthread_rwlock_unlock(&id_lock);
+   return id;
+}
+
+/*
+Registers an id for a node as seen from a view. Registering a view
+resolves its dependencies, so tree_lock must then be held exclusively.
+*/
+uint64_t register_view_node(entrydata_t* view, entrydata_t* node) {
+   pthread_rwlock_wrlock(&id_lock);
+   uint64_t id = idmap_get(vn_to_id, view, node);
+   if (id) {
+      // Registered by another request in the meantime.
+      pthread_rwlock_unlock(&id_lock);
+      return id;
+   }
+   id = alloc_id(view, node);
+   pthread_rwlock_unlock(&id_lock);
 
    if (node && node->type == ET_VIEW) {
       scan_dependencies(node, node);
@@ -336,149 +984,950 @@ uint64_t register_view_node(entrydata_t* view, entrydata_t* node) {
    return id;
 }
 
-void view_inotify(struct inotify_event* event) {
-   char* base = NULL;
+/*
+Removes a package along with all of its versions. Events still
+queued for its watch find the package node dead and are ignored,
+so the node itself is kept.
+*/
+static void remove_package(const char* package) {
+   entrydata_t* package_node = stringset_get(packages_root_node->u.dir.entries, package);
+   if (!package_node)
+      return;
+   vect_t* versions = package_node->u.dir.versions;
+   while (versions && versions->used > 0) {
+      entrydata_t* view = versions->array[versions->used - 1];
+      remove_view(package_node, view->u.view->version);
+   }
+   if (stringset_remove(packages_root_node->u.dir.entries, package, NULL))
+      entrydata_count_subdir(packages_root_node, package_node, -1);
+   package_node->flags |= EF_DEAD;
+}
+
+static int64_t now() {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+Frees a view that nothing refers to any more, along with its links.
+*/
+static void delete_view(entrydata_t* view) {
+   if (view->u.view->dep_rules)
+      list_delete(view->u.view->dep_rules, dep_delete);
+   view->u.view->dep_rules = NULL;
+   entrydata_delete(view);
+}
+
+static void discard_build(pendingversion_t* pending) {
+   if (pending->building) {
+      pending->stale = true;
+   } else if (pending->tree) {
+      entrydata_delete(pending->tree);
+      delete_view(pending->view);
+      pending->tree = NULL;
+      pending->view = NULL;
+   }
+}
+
+static void* version_worker(void* unused);
+
+static void watch_version(pendingversion_t* pending, const char* dirname) {
+   if (version_fd < 0) {
+      // Started on first use, after the daemon has forked.
+      version_fd = inotify_init1(IN_CLOEXEC);
+      if (version_fd < 0) {
+         fprintf(stderr, "viewfs: failed creating inotify instance for %s\n", dirname);
+         return;
+      }
+      pthread_create(&version_thread, NULL, version_worker, NULL);
+   }
+   int wd = inotify_add_watch(version_fd, dirname, VERSION_EVENTS);
+   if (wd < 0) {
+      fprintf(stderr, "viewfs: failed creating watch %s\n", dirname);
+      return;
+   }
+   stringset_remove_int(version_watches, wd, NULL);
+   stringset_put_int(version_watches, wd, pending);
+   pending->wd = wd;
+}
+
+static void unwatch_version(pendingversion_t* pending) {
+   if (pending->wd <= 0)
+      return;
+   stringset_remove_int(version_watches, pending->wd, NULL);
+   inotify_rm_watch(version_fd, pending->wd);
+   pending->wd = 0;
+}
+
+/*
+Frees a pending version once it is neither queued nor being built,
+removing the watch on its directory.
+*/
+static void release_pending(pendingversion_t* pending) {
+   if (pending->queued || pending->building || pending->tree)
+      return;
+   unwatch_version(pending);
+   char* key;
+   asprintf(&key, "%s/%s", pending->package_node->name, pending->version);
+   stringset_remove(pending_versions, key, NULL);
+   free(key);
+   free(pending->version);
+   free(pending);
+}
+
+static pendingversion_t* pending_version(entrydata_t* package_node, const char* version) {
+   char* key;
+   asprintf(&key, "%s/%s", package_node->name, version);
+   pendingversion_t* pending = stringset_get(pending_versions, key);
+   if (!pending) {
+      pending = calloc(1, sizeof(pendingversion_t));
+      pending->version = strdup(version);
+      stringset_put(pending_versions, key, pending);
+   }
+   free(key);
+   if (pending->package_node != package_node) {
+      // The package was removed and installed again.
+      discard_build(pending);
+      unwatch_version(pending);
+      pending->package_node = package_node;
+      pending->add = pending->remove = false;
+   }
+   return pending;
+}
+
+static void queue_version(pendingversion_t* pending) {
+   pending->give_up = now() + 10 * settle_delay;
+   if (!pending->queued) {
+      pending->queued = true;
+      vect_add(event_queue, pending);
+   }
+}
+
+static void queue_add(entrydata_t* package_node, const char* version) {
+   pendingversion_t* pending = pending_version(package_node, version);
+   char* dirname;
+   asprintf(&dirname, "%s/%s/%s", watch_dir, package_node->name, version);
+   if (pending->wd <= 0 && settle_delay > 0)
+      watch_version(pending, dirname);
+   // Checked after creating the watch, so that a Manifest written
+   // in between is not missed.
+   char* manifest;
+   asprintf(&manifest, "%s/%s", dirname, MANIFEST_FILE);
+   pending->manifest_ready = (access(manifest, F_OK) == 0);
+   free(manifest);
+   free(dirname);
+   pending->add = true;
+   queue_version(pending);
+}
+
+static void queue_remove(entrydata_t* package_node, const char* version) {
+   pendingversion_t* pending = pending_version(package_node, version);
+   // An addition not yet processed is simply cancelled.
+   pending->add = false;
+   pending->remove = true;
+   discard_build(pending);
+   unwatch_version(pending);
+   queue_version(pending);
+}
+
+static void queue_package(char* package) {
+   entrydata_t* package_node = add_package_node(package);
+   char* dirname;
+   asprintf(&dirname, "%s/%s", watch_dir, package);
+   DIR* d = opendir(dirname);
+   free(dirname);
+   if (!d)
+      return;
+   struct dirent* version;
+   while ( (version = readdir(d)) ) {
+      if (version->d_name[0] == '.')
+         continue;
+      queue_add(package_node, version->d_name);
+   }
+   closedir(d);
+}
+
+static void* build_worker(void* unused) {
+   (void) unused;
+   pthread_mutex_lock(&build_lock);
+   while (true) {
+      while (build_next == build_queue->used)
+         pthread_cond_wait(&build_wanted, &build_lock);
+      pendingversion_t* pending = build_queue->array[build_next++];
+      if (build_next == build_queue->used)
+         build_queue->used = build_next = 0;
+      entrydata_t* view = pending->view;
+      pthread_mutex_unlock(&build_lock);
+
+      viewdata_t* data = view->u.view;
+      entrydata_t* tree = entrydata_new(ET_DIR, stringset_new(NULL), NULL, NULL);
+      fill_with_view(view, tree);
+      load_dep_rules(data);
+
+      pthread_mutex_lock(&build_lock);
+      pending->tree = tree;
+      vect_add(built, pending);
+      __atomic_store_n(&built_count, built->used, __ATOMIC_RELEASE);
+   }
+   return NULL;
+}
+
+static void build_view(pendingversion_t* pending) {
+   entrydata_t* package_node = pending->package_node;
+   pending->view = entrydata_new(ET_VIEW, package_node->name, pending->version);
+   pending->building = true;
+   pending->stale = false;
+   pthread_mutex_lock(&build_lock);
+   if (!build_started) {
+      // Started on first use, after the daemon has forked.
+      pthread_create(&build_thread, NULL, build_worker, NULL);
+      build_started = true;
+   }
+   vect_add(build_queue, pending);
+   pthread_cond_signal(&build_wanted);
+   pthread_mutex_unlock(&build_lock);
+}
+
+static void collect_built() {
+   if (__atomic_load_n(&built_count, __ATOMIC_ACQUIRE) == 0)
+      return;
+   pthread_mutex_lock(&build_lock);
+   vect_t* views = built;
+   built = vect_new(16);
+   __atomic_store_n(&built_count, 0, __ATOMIC_RELEASE);
+   pthread_mutex_unlock(&build_lock);
+   for (int64_t i = 0; i < views->used; i++) {
+      pendingversion_t* pending = views->array[i];
+      pending->building = false;
+      if (pending->stale || !pending->add) {
+         pending->stale = false;
+         discard_build(pending);
+      }
+      release_pending(pending);
+   }
+   vect_delete(views);
+}
+
+static bool has_version(entrydata_t* package_node, const char* version) {
+   return package_node->u.dir.entries && stringset_get(package_node->u.dir.entries, version);
+}
+
+static void publish_view(pendingversion_t* pending) {
+   entrydata_t* package_node = pending->package_node;
+   entrydata_t* view = pending->view;
+   entrydata_add_version(package_node, pending->version, view);
+   version_epoch++;
+   if (view->u.view->touched)
+      view->u.view->touched->used = 0;
+   merge_tree(tree_root_node, pending->tree, view);
+   links_changed(view);
+   entrydata_delete(pending->tree);
+   pending->tree = NULL;
+   pending->view = NULL;
+   satisfy_depwaits(view);
+}
+
+static void release_id(uint64_t id);
+
+static int compare_pointers(const void* a, const void* b) {
+   uintptr_t pa = (uintptr_t) *(void* const*) a;
+   uintptr_t pb = (uintptr_t) *(void* const*) b;
+   return (pa > pb) - (pa < pb);
+}
+
+/*
+Frees the entries and views removed while applying a batch. Ids that
+refer to them are pointed at stand-ins, answered with ENOENT until the
+kernel forgets them, and ids of moved links follow the copies.
+Called holding tree_lock exclusively, so no request is using them.
+*/
+static void reclaim_removed() {
+   if (dead_entries->used == 0 && removed_views->used == 0)
+      return;
+   pthread_rwlock_wrlock(&id_lock);
+   for (uint64_t id = 1; id < (uint64_t) id_to_n->used; id++) {
+      entrydata_t* view = id_to_v->array[id];
+      entrydata_t* node = id_to_n->array[id];
+      if (!node || node == &dead_entry)
+         continue;
+      if (node->flags & EF_MOVED) {
+         idmap_remove(vn_to_id, view, node);
+         node = node->parent;
+         id_to_n->array[id] = node;
+         idmap_put(vn_to_id, view, node, id);
+      }
+      if ((node->flags & EF_DEAD) || (view && view->u.view->removed)
+                 || (node->type == ET_VIEW && node->u.view->removed)) {
+         idmap_remove(vn_to_id, view, node);
+         id_to_v->array[id] = &removed_view;
+         id_to_n->array[id] = &dead_entry;
+         free(id_to_link->array[id]);
+         id_to_link->array[id] = NULL;
+         if (id_listed->array[id])
+            release_id(id);
+      }
+   }
+   pthread_rwlock_unlock(&id_lock);
+   // The views sharing moved links still list them as touched.
+   vect_t* sharing = vect_new(8);
+   for (int64_t i = 0; i < dead_entries->used; i++) {
+      entrydata_t* entry = dead_entries->array[i];
+      if (!(entry->flags & EF_MOVED))
+         continue;
+      for (int j = 0; entry->parent->u.link.view[j]; j++)
+         vect_add(sharing, entry->parent->u.link.view[j]);
+   }
+   qsort(sharing->array, sharing->used, sizeof(void*), compare_pointers);
+   for (int64_t i = 0; i < sharing->used; i++) {
+      vect_t* touched = ((entrydata_t*) sharing->array[i])->u.view->touched;
+      if ((i > 0 && sharing->array[i] == sharing->array[i-1]) || !touched)
+         continue;
+      for (int64_t j = 0; j < touched->used; j++) {
+         entrydata_t* entry = touched->array[j];
+         if (entry->flags & EF_MOVED)
+            touched->array[j] = entry->parent;
+      }
+   }
+   vect_delete(sharing);
+   for (int i = 0; i < LISTINGS; i++)
+      listings[i].dir = NULL;
+   for (int64_t i = 0; i < dead_entries->used; i++)
+      entrydata_delete(dead_entries->array[i]);
+   for (int64_t i = 0; i < removed_views->used; i++)
+      delete_view(removed_views->array[i]);
+   dead_entries->used = 0;
+   removed_views->used = 0;
+}
+
+/*
+Sets when the queue next needs to be looked at: once the batch is
+due, or a Manifest has been waited for long enough. Versions being
+built are looked at when the build thread hands them back.
+*/
+static void schedule_flush() {
+   int64_t next = INT64_MAX;
+   bool building = false;
+   for (int64_t i = 0; i < event_queue->used; i++) {
+      pendingversion_t* pending = event_queue->array[i];
+      building = building || pending->building;
+   }
+   for (int64_t i = 0; i < event_queue->used; i++) {
+      pendingversion_t* pending = event_queue->array[i];
+      if (pending->building)
+         continue;
+      if (pending->add && !pending->tree && !pending->manifest_ready && !(pending->package_node->flags & EF_DEAD)) {
+         if (pending->give_up < next)
+            next = pending->give_up;
+      } else if (!building && batch_deadline < next) {
+         next = batch_deadline;
+      }
+   }
+   __atomic_store_n(&next_flush, next, __ATOMIC_RELEASE);
+}
+
+/*
+Applies the queued changes in one batch, once no events have arrived
+for settle_delay. There is no timer in the FUSE loop, so this is
+called on every event and before every request is served.
+
+Additions are handed to the build thread as soon as their Manifest is
+complete (or has been waited for long enough), and the resulting trees
+are merged into the main tree when the batch is applied, so requests
+see either none or all of a view. Changes are applied in the order
+they were queued, stopping at a version still being built.
+Called holding tree_lock exclusively.
+*/
+static void apply_events() {
+   collect_built();
+   int64_t time = now();
+   for (int64_t i = 0; i < event_queue->used; i++) {
+      pendingversion_t* pending = event_queue->array[i];
+      entrydata_t* package_node = pending->package_node;
+      if (!pending->add || pending->building || pending->tree || (package_node->flags & EF_DEAD))
+         continue;
+      if (!pending->manifest_ready && time < pending->give_up)
+         continue;
+      if (!has_version(package_node, pending->version) || pending->remove)
+         build_view(pending);
+   }
+   if (time < batch_deadline) {
+      reclaim_removed();
+      schedule_flush();
+      return;
+   }
+   int64_t kept = 0;
+   bool blocked = false;
+   for (int64_t i = 0; i < event_queue->used; i++) {
+      pendingversion_t* pending = event_queue->array[i];
+      entrydata_t* package_node = pending->package_node;
+      bool dead = (package_node->flags & EF_DEAD);
+      blocked = blocked || pending->building;
+      if (blocked || (pending->add && !pending->tree && !dead && (pending->remove || !has_version(package_node, pending->version)))) {
+         event_queue->array[kept++] = pending;
+         continue;
+      }
+      pending->queued = false;
+      if (dead) {
+         discard_build(pending);
+      } else {
+         if (pending->remove)
+            remove_view(package_node, pending->version);
+         if (pending->tree && !has_version(package_node, pending->version))
+            publish_view(pending);
+         else
+            discard_build(pending);
+      }
+      pending->add = pending->remove = false;
+      release_pending(pending);
+   }
+   event_queue->used = kept;
+   reclaim_removed();
+   schedule_flush();
+}
+
+static void flush_events() {
+   int64_t next = __atomic_load_n(&next_flush, __ATOMIC_ACQUIRE);
+   if (__atomic_load_n(&built_count, __ATOMIC_ACQUIRE) == 0 && (next == INT64_MAX || now() < next))
+      return;
+   pthread_rwlock_wrlock(&tree_lock);
+   apply_events();
+   pthread_rwlock_unlock(&tree_lock);
+}
+
+/*
+Events inside a version directory being installed. Anything written
+there delays the batch; the Manifest is complete once it is closed
+or moved into place. A view built from an older Manifest or
+Dependencies file is built again.
+*/
+static void version_inotify(pendingversion_t* pending, struct inotify_event* event) {
+   if (!pending->queued)
+      return;
+   batch_deadline = now() + settle_delay;
+   pending->give_up = now() + 10 * settle_delay;
+   if (!event->len)
+      return;
+   if (strcmp(event->name, DEPENDENCIES_FILE) == 0) {
+      discard_build(pending);
+   } else if (strcmp(event->name, MANIFEST_FILE) == 0) {
+      discard_build(pending);
+      if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+         pending->manifest_ready = true;
+      else if (event->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM))
+         pending->manifest_ready = false;
+   }
+}
+
+static void handle_event(struct inotify_event* event) {
    char* name = event->len ? event->name : NULL;
+   entrydata_t* package_node = NULL;
    if (event->wd > 0) {
-      for (int i = 1; i < watches->used; i++) {
-         inodewatch_t* w = (inodewatch_t*) watches->array[i];
-         if (w->wd == event->wd) {
-            base = w->name;
-            break;
-         }
-      }
-      if (!base) {
+      package_node = vect_get(wd_to_package, event->wd);
+      if (!package_node || (package_node->flags & EF_DEAD)) {
          fprintf(stderr, "viewfs: event on unregistered inode.\n");
          return;
       }
-      base = strrchr(base, '/');
-      assert(base);
-      base++;
    }
    if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
       if (event->wd == 0) {
-         add_package(name);
+         queue_package(name);
       } else {
-         entrydata_t* package_node = stringset_get_i(packages_root_node->u.dir.entries, base);
-         add_view(package_node, base, event->name);
+         queue_add(package_node, event->name);
       }
    } else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
-      // TODO: handle removal
-      /*
       if (event->wd == 0) {
-         entrydata_t* entry;
-         entry = stringset_get(root_set, event->name);
-         if (!entry || entry->type != ET_DIR)
-            return;
-         stringset_scan(entry->u.dir.entries, remove_view, event->name);
+         remove_package(name);
       } else {
-         entrydata_t *baseentry, *entry;
-         baseentry = stringset_get(root_set, base);
-         if (!baseentry || baseentry->type != ET_DIR)
-            return;
-           entry = stringset_get(baseentry->u.dir.entries, event->name);
-         if (!entry)
-            return;
-         remove_view(base, event->name, entry);
+         queue_remove(package_node, event->name);
       }
-      */
    }
+   batch_deadline = now() + settle_delay;
 }
 
-int view_readlink(uint64_t id, char* buf, size_t bufsiz) {
-   entrydata_t *view, *node;
-   id_to_view_node(id, &view, &node);
-   // TODO: detect a dead node
-   if (node->type != ET_LINK) {
-      return -EINVAL;
+void view_inotify(struct inotify_event* event) {
+   pthread_rwlock_wrlock(&tree_lock);
+   handle_event(event);
+   apply_events();
+   pthread_rwlock_unlock(&tree_lock);
+}
+
+/*
+Reads the events on the version directories being installed.
+*/
+static void* version_worker(void* unused) {
+   (void) unused;
+   char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+   while (true) {
+      ssize_t len = read(version_fd, buf, sizeof(buf));
+      if (len < 0 && errno == EINTR)
+         continue;
+      if (len <= 0) {
+         fprintf(stderr, "viewfs: failed reading events on version directories\n");
+         return NULL;
+      }
+      pthread_rwlock_wrlock(&tree_lock);
+      for (char* at = buf; at < buf + len; ) {
+         struct inotify_event* event = (struct inotify_event*) at;
+         pendingversion_t* pending = stringset_get_int(version_watches, event->wd);
+         if (pending && (event->mask & IN_IGNORED)) {
+            // The directory went away, taking the watch with it.
+            stringset_remove_int(version_watches, event->wd, NULL);
+            pending->wd = 0;
+         } else if (pending) {
+            version_inotify(pending, event);
+         }
+         at += sizeof(struct inotify_event) + event->len;
+      }
+      apply_events();
+      pthread_rwlock_unlock(&tree_lock);
+   }
+}
+
+static int compare_ranks(const void* a, const void* b) {
+   const viewrank_t* ra = a;
+   const viewrank_t* rb = b;
+   if (ra->index != rb->index)
+      return ra->index < rb->index ? -1 : 1;
+   return ra->rank - rb->rank;
+}
+
+/*
+Rebuilds the ranks of a view from its priority list,
+if the list may have changed since it was last built.
+*/
+static void update_rank(viewdata_t* view) {
+   if (view->ranks && view->rank_epoch >= view->priority_epoch)
+      return;
+   int count = 0;
+   list_foreach(entrydata_t, priority_view, view->priority_views) {
+      (void) priority_view;
+      count++;
+   }
+   free(view->ranks);
+   view->ranks = malloc((count + 1) * sizeof(viewrank_t));
+   int position = 1;
+   list_foreach(entrydata_t, priority_view, view->priority_views) {
+      view->ranks[position - 1].index = priority_view->u.view->index;
+      view->ranks[position - 1].rank = position;
+      position++;
+   }
+   qsort(view->ranks, count, sizeof(viewrank_t), compare_ranks);
+   // Keep the first position of views listed more than once.
+   int kept = 0;
+   for (int i = 0; i < count; i++) {
+      if (kept == 0 || view->ranks[kept - 1].index != view->ranks[i].index)
+         view->ranks[kept++] = view->ranks[i];
    }
-   entrydata_t* chosen = NULL;
+   view->rank_count = kept;
+   view->rank_epoch = link_epoch;
+}
+
+static int find_rank(viewdata_t* view, int index) {
+   int low = 0, high = view->rank_count;
+   while (low < high) {
+      int mid = (low + high) / 2;
+      if (view->ranks[mid].index < index)
+         low = mid + 1;
+      else
+         high = mid;
+   }
+   if (low < view->rank_count && view->ranks[low].index == index)
+      return view->ranks[low].rank;
+   return 0;
+}
+
+static int resolve_link(entrydata_t* view, entrydata_t* node, char* buf, size_t bufsiz) {
+   entrydata_t* chosen = node->u.link.view[0];
    if (view->u.view->priority_views) {
-      list_foreach(entrydata_t, priority_view, view->u.view->priority_views) {
-         for (int i = 0; node->u.link.view[i]; i++) {
-            if (node->u.link.view[i] == priority_view) {
-               chosen = node->u.link.view[i];
-               break;
-            }
+      viewdata_t* data = view->u.view;
+      pthread_mutex_t* rank_lock = &rank_locks[data->index % RANK_LOCKS];
+      pthread_mutex_lock(rank_lock);
+      update_rank(data);
+      int best = 0;
+      for (int i = 0; node->u.link.view[i]; i++) {
+         int rank = find_rank(data, node->u.link.view[i]->u.view->index);
+         if (rank && (!best || rank < best)) {
+            best = rank;
+            chosen = node->u.link.view[i];
          }
-         if (chosen)
-            break;
       }
+      pthread_mutex_unlock(rank_lock);
    }
-   if (!chosen)
-      chosen = node->u.link.view[0];
-   snprintf(buf, bufsiz, "%s/%s/%s/%s", watch_dir, chosen->u.view->package, chosen->u.view->version, node->u.link.path);
+   int len = snprintf(buf, bufsiz, "%s/%s/%s/", watch_dir, chosen->u.view->package, chosen->u.view->version);
+   if (len < 0 || (size_t) len >= bufsiz)
+      return -1;
+   int pathlen = entrydata_path(node, buf + len, bufsiz - len);
+   if (pathlen < 0)
+      return -1;
+   return len + pathlen;
+}
 
+/*
+Copies the target of a link into buf, resolving it again if the
+cached one may be out of date. Called holding the link lock of the id.
+*/
+static int read_link(uint64_t id, char* buf, size_t bufsiz) {
+   entrydata_t *view, *node;
+   lookup_id(id, &view, &node);
+   if (is_dead(view, node))
+      return -ENOENT;
+   if (node->type != ET_LINK) {
+      return -EINVAL;
+   }
+   linkcache_t* cached = id_to_link->array[id];
+   if (!cached || cached->epoch < view->u.view->priority_epoch || cached->epoch < node->u.link.epoch) {
+      char target[PATH_MAX];
+      int len = resolve_link(view, node, target, PATH_MAX);
+      if (len < 0)
+         return -ENAMETOOLONG;
+      if (!cached || cached->len < len) {
+         free(cached);
+         cached = malloc(sizeof(linkcache_t) + len + 1);
+         id_to_link->array[id] = cached;
+      }
+      memcpy(cached->target, target, len + 1);
+      cached->len = len;
+      cached->epoch = link_epoch;
+   }
+   if ((size_t) cached->len >= bufsiz)
+      return -ENAMETOOLONG;
+   memcpy(buf, cached->target, cached->len + 1);
    return 0;
 }
 
-void view_forget(uint64_t id) {
-   entrydata_t *view, *node;
-   id_to_view_node(id, &view, &node);
-   if (view == 0)
-      return;
+int view_readlink(uint64_t id, char* buf, size_t bufsiz) {
+   flush_events();
+   pthread_mutex_t* link_lock = &link_locks[id % LINK_LOCKS];
+   pthread_rwlock_rdlock(&tree_lock);
+   pthread_rwlock_rdlock(&id_lock);
+   pthread_mutex_lock(link_lock);
+   int result = read_link(id, buf, bufsiz);
+   pthread_mutex_unlock(link_lock);
+   pthread_rwlock_unlock(&id_lock);
+   pthread_rwlock_unlock(&tree_lock);
+   return result;
+}
+
+static void release_id(uint64_t id) {
+   // Unregister the pair as it was registered, not as remapped for views.
+   idmap_remove(vn_to_id, id_to_v->array[id], id_to_n->array[id]);
    id_to_v->array[id] = NULL;
    id_to_n->array[id] = NULL;
-   vect_add(free_ids, (void*)(uint32_t) id);
-   stringset_t* nodeset = stringset_get_int(vn_to_id, (int) view);
-   stringset_remove_int(nodeset, (int) node, NULL);
+   free(id_to_link->array[id]);
+   id_to_link->array[id] = NULL;
+   id_listed->array[id] = NULL;
+   vect_add(free_ids, (void*)(uintptr_t) id);
    forgotten++;
 }
 
-int view_getdir(uint64_t id, dirbuffer_t* h, getdir_fn_t filler) {
+/*
+Forgets an id, along with the ids registered for the entries of its
+directory that were listed but never looked up.
+*/
+void view_forget(uint64_t id) {
+   pthread_rwlock_rdlock(&tree_lock);
+   pthread_rwlock_wrlock(&id_lock);
+   entrydata_t *view, *node;
+   lookup_id(id, &view, &node);
+   if (view) {
+      if (node->type == ET_DIR && node->u.dir.entries) {
+         stringset_begin_iterate(entrydata_t, item, node->u.dir.entries);
+            uint64_t child = idmap_get(vn_to_id, view, item);
+            if (child && id_listed->array[child])
+               release_id(child);
+         stringset_end_iterate(item);
+      }
+      release_id(id);
+   }
+   pthread_rwlock_unlock(&id_lock);
+   pthread_rwlock_unlock(&tree_lock);
+}
+
+/*
+Registers ids for the entries of a directory being listed, so that the
+lookups likely to follow find them without taking id_lock exclusively
+one by one. Views are left to lookup, since registering them resolves
+their dependencies.
+*/
+static void register_listed(entrydata_t* view, vect_t* entries) {
+   pthread_rwlock_wrlock(&id_lock);
+   for (int64_t i = 0; i < entries->used; i++) {
+      entrydata_t* entry = entries->array[i];
+      if (idmap_get(vn_to_id, view, entry))
+         continue;
+      uint64_t id = alloc_id(view, entry);
+      id_listed->array[id] = (void*) 1;
+   }
+   pthread_rwlock_unlock(&id_lock);
+}
+
+/*
+Hashes a name into the cookie of its entry, with FNV-1a. Cookies are
+positive, since negative offsets ask for no offsets at all, and never
+0, which starts a listing.
+*/
+static int64_t listing_cookie(const char* name) {
+   uint64_t hash = 0xcbf29ce484222325ULL;
+   for (const unsigned char* c = (const unsigned char*) name; *c; c++) {
+      hash ^= *c;
+      hash *= 0x100000001b3ULL;
+   }
+   hash &= INT64_MAX;
+   return hash ? (int64_t) hash : 1;
+}
+
+static int compare_listing_entries(const void* a, const void* b) {
+   const listingentry_t* ea = a;
+   const listingentry_t* eb = b;
+   if (ea->cookie != eb->cookie)
+      return ea->cookie < eb->cookie ? -1 : 1;
+   return strcmp(ea->name, eb->name);
+}
+
+static void build_listing(listing_t* listing, entrydata_t* dir) {
+   stringset_t* set = dir->u.dir.entries;
+   free(listing->entries);
+   free(listing->strings);
+   listing->entries = malloc(set->count * sizeof(listingentry_t));
+   size_t* at = malloc(set->count * sizeof(size_t));
+   size_t size = 4096, used = 0;
+   char* strings = malloc(size);
+   int count = 0;
+   stringset_iter_t* iter = stringset_iter_new(set);
+   entrydata_t* item;
+   while ( (item = (entrydata_t*) stringset_iter_next(iter)) ) {
+      size_t len = strlen(iter->key) + 1;
+      while (used + len > size) {
+         size *= 2;
+         strings = realloc(strings, size);
+      }
+      memcpy(strings + used, iter->key, len);
+      at[count] = used;
+      listing->entries[count].cookie = listing_cookie(iter->key);
+      listing->entries[count++].entry = item;
+      used += len;
+   }
+   stringset_iter_delete(iter);
+   // Names are pointed to once the strings have stopped moving.
+   for (int i = 0; i < count; i++)
+      listing->entries[i].name = strings + at[i];
+   free(at);
+   qsort(listing->entries, count, sizeof(listingentry_t), compare_listing_entries);
+   listing->strings = strings;
+   listing->count = count;
+   listing->dir = dir;
+   listing->generation = set->generation;
+}
+
+/*
+Returns the position in a listing of the first entry after offset.
+*/
+static int listing_find(listing_t* listing, int64_t offset) {
+   int low = 0, high = listing->count;
+   while (low < high) {
+      int mid = (low + high) / 2;
+      if (listing->entries[mid].cookie <= offset)
+         low = mid + 1;
+      else
+         high = mid;
+   }
+   return low;
+}
+
+/*
+Passes an entry to filler. Entries it takes are added to
+unregistered if they have no id yet. Returns nonzero once
+the buffer is full.
+*/
+static int list_entry(dirbuffer_t* h, getdir_fn_t filler, entrydata_t* view, const char* name, entrydata_t* item, int64_t off, vect_t** unregistered) {
+   if (filler(h, name, (item->type == ET_LINK ? DT_LNK : DT_DIR), off) != 0)
+      return 1;
+   if (view && item->type != ET_VIEW && !idmap_get(vn_to_id, view, item)) {
+      if (!*unregistered)
+         *unregistered = vect_new(64);
+      vect_add(*unregistered, item);
+   }
+   return 0;
+}
+
+/*
+Lists the entries of a directory in cookie order, from the first one
+after offset on, until filler reports the buffer full. Each entry is
+passed its cookie, to resume after it; offset 0 starts the listing.
+Since cookies do not depend on the other entries, resuming a listing
+after entries were added or removed neither skips nor repeats the
+others. Should two names hash to the same cookie, a listing resumed
+between them would skip the second. A negative offset lists the whole
+directory without offsets, as getdir expects.
+Returns -EAGAIN if pending Manifests have to be loaded first,
+unless tree_lock is held exclusively.
+*/
+static int list_dir(uint64_t id, int64_t offset, dirbuffer_t* h, getdir_fn_t filler, bool exclusive) {
    entrydata_t *view, *node;
    id_to_view_node(id, &view, &node);
-   // TODO: detect a dead node
+   if (is_dead(view, node))
+      return -ENOENT;
    if (node->type != ET_DIR) {
       return -EINVAL;
    }
-   if (node->u.dir.entries) {
-      stringset_iter_t* iter = stringset_iter_new(node->u.dir.entries);
+   if (node->u.dir.pending || (node == tree_root_node && pending_hints > 0)) {
+      if (!exclusive)
+         return -EAGAIN;
+      materialize(node);
+      if (node == tree_root_node)
+         materialize_hints();
+   }
+   stringset_t* set = node->u.dir.entries;
+   if (!set)
+      return 0;
+   bool positions = (offset >= 0);
+   vect_t* unregistered = NULL;
+   if (set->count >= LISTING_MIN || positions) {
+      listing_t local = { 0 };
+      listing_t* listing = &local;
+      int slot = -1;
+      if (set->count >= LISTING_MIN) {
+         slot = ((uintptr_t) node / sizeof(entrydata_t)) % LISTINGS;
+         listing = &listings[slot];
+         pthread_mutex_lock(&listing_locks[slot]);
+         if (listing->dir != node || listing->generation != set->generation)
+            build_listing(listing, node);
+      } else {
+         build_listing(listing, node);
+      }
+      pthread_rwlock_rdlock(&id_lock);
+      for (int i = positions ? listing_find(listing, offset) : 0; i < listing->count; i++) {
+         listingentry_t* entry = &listing->entries[i];
+         if (list_entry(h, filler, view, entry->name, entry->entry, positions ? entry->cookie : -1, &unregistered))
+            break;
+      }
+      pthread_rwlock_unlock(&id_lock);
+      if (slot >= 0) {
+         pthread_mutex_unlock(&listing_locks[slot]);
+      } else {
+         free(local.entries);
+         free(local.strings);
+      }
+   } else {
+      stringset_iter_t* iter = stringset_iter_new(set);
       entrydata_t* item;
-      while (item = (entrydata_t*) stringset_iter_next(iter)) {
-         filler(h, iter->key, (item->type == ET_LINK ? DT_LNK : DT_DIR), -1);
+      pthread_rwlock_rdlock(&id_lock);
+      while ( (item = (entrydata_t*) stringset_iter_next(iter)) ) {
+         if (list_entry(h, filler, view, iter->key, item, -1, &unregistered))
+            break;
       }
+      pthread_rwlock_unlock(&id_lock);
       stringset_iter_delete(iter);
    }
+   if (unregistered) {
+      register_listed(view, unregistered);
+      vect_delete(unregistered);
+   }
    return 0;
 }
 
+/*
+Lists a directory from after offset on, for FUSE layers that page
+through large directories; a negative offset lists all of it.
+*/
+int view_readdir(uint64_t id, int64_t offset, dirbuffer_t* h, getdir_fn_t filler) {
+   flush_events();
+   pthread_rwlock_rdlock(&tree_lock);
+   int result = list_dir(id, offset, h, filler, false);
+   pthread_rwlock_unlock(&tree_lock);
+   if (result == -EAGAIN) {
+      pthread_rwlock_wrlock(&tree_lock);
+      result = list_dir(id, offset, h, filler, true);
+      pthread_rwlock_unlock(&tree_lock);
+   }
+   return result;
+}
+
+int view_getdir(uint64_t id, dirbuffer_t* h, getdir_fn_t filler) {
+   return view_readdir(id, -1, h, filler);
+}
+
 int view_getattr(uint64_t id, struct stat *stbuf) {
 //fprintf(stderr, "GETATTR %lld.\n", id);
+   flush_events();
    entrydata_t *view, *node;
+   pthread_rwlock_rdlock(&tree_lock);
    id_to_view_node(id, &view, &node);
+   bool dead = is_dead(view, node);
+   bool link = (node->type == ET_LINK);
+   // Views still pending on a directory may add subdirectories to it.
+   bool counted = !link && !node->u.dir.pending && !(node == tree_root_node && pending_hints > 0);
+   unsigned int subdirs = node->subdirs;
+   pthread_rwlock_unlock(&tree_lock);
+   if (dead)
+      return -ENOENT;
    memset(stbuf, 0, sizeof(struct stat));
-   if (node->type == ET_LINK) {
+   if (link) {
       stbuf->st_mode = S_IFLNK | 0755;
       stbuf->st_nlink = 1;
    } else {
       stbuf->st_mode = S_IFDIR | 0755;
-      stbuf->st_nlink = 1; // get_dir_link_count(id);
+      // "." and ".." plus one ".." per subdirectory; 1 tells find(1)
+      // the count is unknown.
+      stbuf->st_nlink = counted ? 2 + subdirs : 1;
    }
    stbuf->st_ino = id;
    return 0;
 }
 
 #define is_root(path) ((path)[1] == '\0' && (path)[0] == '/')
-int view_lookup(uint64_t id, char* name, uint64_t* result) {
+/*
+Returns -EAGAIN if pending Manifests have to be loaded, or the
+dependencies of a view resolved, unless tree_lock is held exclusively.
+*/
+static int lookup(uint64_t id, char* name, uint64_t* result, bool exclusive) {
    entrydata_t *view, *node;
    id_to_view_node(id, &view, &node);
-   if (node->type != ET_DIR) {
+   if (node->type != ET_DIR || is_dead(view, node)) {
       return -ENOENT;
    }
+   if (node->u.dir.pending) {
+      if (!exclusive)
+         return -EAGAIN;
+      materialize(node);
+   }
    entrydata_t* child = NULL;
    if (node->u.dir.entries)
       child = stringset_get(node->u.dir.entries, name);
+   if (child && (child->flags & EF_HINT)) {
+      if (!exclusive)
+         return -EAGAIN;
+      materialize(child);
+      if (child->flags & EF_DEAD)
+         child = NULL;
+   }
    if (!child)
       return -ENOENT;
 
-   *result = view_node_to_id(view, child);
-   if (!*result)
+   *result = claim_id(view, child);
+   if (!*result) {
+      if (child->type == ET_VIEW && !exclusive)
+         return -EAGAIN;
       *result = register_view_node(view, child);
+   }
 
    return 0;
 }
 
+int view_lookup(uint64_t id, char* name, uint64_t* result) {
+   flush_events();
+   pthread_rwlock_rdlock(&tree_lock);
+   int err = lookup(id, name, result, false);
+   pthread_rwlock_unlock(&tree_lock);
+   if (err == -EAGAIN) {
+      pthread_rwlock_wrlock(&tree_lock);
+      err = lookup(id, name, result, true);
+      pthread_rwlock_unlock(&tree_lock);
+   }
+   return err;
+}
+
 static directfuse_ops_t view_operations = {
    .lookup       = view_lookup,
    .getattr      = view_getattr,
@@ -490,26 +1939,52 @@ static directfuse_ops_t view_operations = {
 
 int main(int argc, char *argv[]) {
    char* mountpoint = NULL;
+   char* snapshot = NULL;
    int foreground = 0;
-   parse_cmdline(argc, argv, &watch_dir, &mountpoint, &foreground);
+   int delay;
+   parse_cmdline(argc, argv, &watch_dir, &mountpoint, &foreground, &lazy, &snapshot, &jobs, &delay);
+   settle_delay = (int64_t) delay * 1000000;
 
-   packages_root_node = entrydata_new(ET_DIR, stringset_new(NULL));
-   tree_root_node = entrydata_new(ET_DIR, stringset_new(NULL));
+   packages_root_node = entrydata_new(ET_DIR, stringset_new(NULL), NULL, NULL);
+   tree_root_node = entrydata_new(ET_DIR, stringset_new(NULL), NULL, NULL);
 
    forgotten = 0;
    watches = vect_new(100);
+   wd_to_package = vect_new(100);
+   version_watches = stringset_new(NULL);
+   pending_versions = stringset_new(NULL);
+   event_queue = vect_new(100);
+   build_queue = vect_new(16);
+   built = vect_new(16);
    id_to_v = vect_new(10000);
    id_to_n = vect_new(10000);
    free_ids = vect_new(1000);
-   vn_to_id = stringset_new();
-   depwait_list = list_new();
+   id_to_link = vect_new(10000);
+   id_listed = vect_new(10000);
+   vn_to_id = idmap_new(10000);
+   for (int i = 0; i < LINK_LOCKS; i++)
+      pthread_mutex_init(&link_locks[i], NULL);
+   for (int i = 0; i < RANK_LOCKS; i++)
+      pthread_mutex_init(&rank_locks[i], NULL);
+   for (int i = 0; i < LISTINGS; i++)
+      pthread_mutex_init(&listing_locks[i], NULL);
+   depwaits = depwaits_new();
+   scanned_views = vect_new(1000);
+   dead_entries = vect_new(64);
+   removed_views = vect_new(8);
    vect_add(watches, inodewatch_new(watch_dir));
 
    register_view_node(NULL, NULL); // id 0
    register_view_node(NULL, packages_root_node); // id 1
    directfuse_init(mountpoint, view_operations, (inodewatch_t**) watches->array);
 
-   scan_watch_dir();
+   if (snapshot && snapshot_load(snapshot, watch_dir, packages_root_node, tree_root_node)) {
+      watch_packages();
+   } else {
+      scan_watch_dir();
+      if (snapshot && !lazy)
+         snapshot_save(snapshot, watch_dir, packages_root_node, tree_root_node);
+   }
 
    directfuse_run(foreground);
    return 0;